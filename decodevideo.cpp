@@ -20,6 +20,7 @@ void scaleImage(AVFrame * pFrame, int scaleX, int scaleY, AVFrame * pScaledFrame
 // Writes a simple image file. Requires a uint8_t array with BGRA pixels. No bounds checking.
 // Unless you are working with FFMPEG or similar libraries like OpenCV, your image is likely not padded.
 int writePPM(std::string outputFileName, int width, int height, uint8_t *data, bool isPadded) {
+    TRACE_SCOPE("write_ppm");
     if ( !(outputFileName.substr(outputFileName.length()-4, 4) == ".ppm") ) outputFileName = outputFileName + ".ppm"; // Add .ppm if not already present
 
     int padCount = (32-(width%32))%32;
@@ -50,6 +51,7 @@ int writePPM(std::string outputFileName, int width, int height, uint8_t *data, b
 }
 
 int writePal8PPM(std::string outputFileName, int width, int height, uint8_t *data, uint8_t *palette) {
+    TRACE_SCOPE("write_pal8_ppm");
     if ( !(outputFileName.substr(outputFileName.length()-4, 4) == ".ppm") ) outputFileName = outputFileName + ".ppm"; // Add .ppm if not already present
 
     std::fstream dstImage(outputFileName, std::ios::out | std::ios::trunc | std::ios::binary);
@@ -78,6 +80,23 @@ int writePal8PPM(std::string outputFileName, int width, int height, uint8_t *dat
 int VideoDecoder::openInputFile() {
     // Create format context (format is container)
     pFormatContext = avformat_alloc_context();
+    if (ioOptions.liveInput) {
+        // Start quickly and hand packets over as soon as they arrive
+        pFormatContext->flags |= AVFMT_FLAG_NOBUFFER;
+        pFormatContext->probesize = 256 * 1024;
+        pFormatContext->max_analyze_duration = AV_TIME_BASE / 2;
+    }
+    if (ioOptions.mode != IO_DEFAULT) {
+        pReadAheadIO = new ReadAheadIO(inputFileName, ioOptions);
+        if (pReadAheadIO->getAVIOContext() != NULL) {
+            pFormatContext->pb = pReadAheadIO->getAVIOContext();
+            pFormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else {
+            std::cerr << "Custom I/O failed, falling back to libavformat file I/O" << std::endl;
+            delete pReadAheadIO;
+            pReadAheadIO = NULL;
+        }
+    }
     if (avformat_open_input(&pFormatContext, inputFileName.c_str(), NULL, NULL) != 0) {
         std::cerr << "avformat_open_input failed!" << std::endl;
         return -1;
@@ -95,6 +114,14 @@ int VideoDecoder::openInputFile() {
     // av_find_best_stream(formatContext, Type of stream, Preferred stream index, Number of related stream, Codec associated with stream, flags)
     videoStreamIndex = av_find_best_stream(pFormatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &pVideoCodec, 0);
 
+    // Live streams often don't know their average frame rate
+    AVStream * pVideoStream = pFormatContext->streams[videoStreamIndex];
+    streamFrameRate = pVideoStream->avg_frame_rate;
+    if (streamFrameRate.num <= 0 || streamFrameRate.den <= 0) streamFrameRate = pVideoStream->r_frame_rate;
+    if (streamFrameRate.num <= 0 || streamFrameRate.den <= 0) streamFrameRate = {25, 1};
+    streamTimeBase = pVideoStream->time_base;
+    streamStartTime = (pVideoStream->start_time == AV_NOPTS_VALUE) ? 0 : pVideoStream->start_time;
+
     // Open codec context to allow for decoding
     pCodecContext = avcodec_alloc_context3(pVideoCodec);
     if (!pCodecContext) {
@@ -134,7 +161,7 @@ int VideoDecoder::initializeFilters() {
     const AVFilter * pBufferSink = avfilter_get_by_name("buffersink");
     AVFilterInOut * pOutputs = avfilter_inout_alloc();
     AVFilterInOut * pInputs  = avfilter_inout_alloc();
-    AVRational timeBase = {av_q2d(pFormatContext->streams[videoStreamIndex]->avg_frame_rate)*1000, 1000};
+    AVRational timeBase = {(int)(av_q2d(streamFrameRate)*1000), 1000};
     //std::cout << pFormatContext->streams[videoStreamIndex]->time_base.num << "/" << pFormatContext->streams[videoStreamIndex]->time_base.den << std::endl;
 
     pFilterGraph = avfilter_graph_alloc();
@@ -142,7 +169,7 @@ int VideoDecoder::initializeFilters() {
         std::cout << "Input, output, or graph failed" << std::endl;
     }
 
-    std::string parseArgs = "buffer=video_size=" + std::to_string(pCodecContext->width) + "x" + std::to_string(pCodecContext->height) + ":pix_fmt=" + std::to_string((int)pCodecContext->pix_fmt) + ":time_base=" + std::to_string((int)(av_q2d(pFormatContext->streams[videoStreamIndex]->avg_frame_rate)*1000)) + "/1000:pixel_aspect=1/1 [in_1];"
+    std::string parseArgs = "buffer=video_size=" + std::to_string(pCodecContext->width) + "x" + std::to_string(pCodecContext->height) + ":pix_fmt=" + std::to_string((int)pCodecContext->pix_fmt) + ":time_base=" + std::to_string((int)(av_q2d(streamFrameRate)*1000)) + "/1000:pixel_aspect=1/1 [in_1];"
                         /*"buffer=video_size=16x16:pix_fmt=" + std::to_string((int)AV_PIX_FMT_RGB32) + ":time_base=" + std::to_string((int)(av_q2d(pFormatContext->streams[videoStreamIndex]->avg_frame_rate)*1000)) + ":pixel_aspect=1/1 [in_2];"*/
                         "[in_1] scale=" + std::to_string(width) + ":" + std::to_string(height) + " [in_1];"
                         "[in_1] format=28 [in_1];"
@@ -175,54 +202,259 @@ int VideoDecoder::initializeFilters() {
 
 
 
+// Returns the next filtered frame, or NULL once the stream is fully drained.
+// The buffer is owned by the decoder and is overwritten by the next call.
 uint8_t* VideoDecoder::readFrame() {
+    if (!takeReadyFrame(resultBuffer)) return NULL;
+    return resultBuffer;
+}
 
+// Returns up to numberOfFrames filtered frames, fewer only at the end of the stream. The whole batch is run through
+// the pipeline in one go. Frames the filter graph already laid out like readFrame's (rows padded to a multiple of
+// 32 pixels) are handed out in place, without a copy, the rest are copied into per-batch buffers.
+// All of them stay valid until the next call to readFrames.
+std::vector<uint8_t*> VideoDecoder::readFrames(int numberOfFrames) {
+    releaseHeldFrames();
+    std::vector<uint8_t*> frames;
+    if (numberOfFrames <= 0) return frames;
+    fillReadyFrames(numberOfFrames);
+
+    int lineSize = (width+padCount) * 4;
+    size_t copiedFrames = 0;
+    while ((int)frames.size() < numberOfFrames && !readyFrames.empty()) {
+        AVFrame *pReadyFrame = readyFrames.front();
+        if (pReadyFrame->linesize[0] == lineSize) {
+            // Keep the reference, the filter graph allocates a new buffer for its next frame
+            readyFrames.pop_front();
+            frameTaken(pReadyFrame);
+            heldFrames.push_back(pReadyFrame);
+            frames.push_back(pReadyFrame->data[0]);
+        } else {
+            if (copiedFrames == batchBuffers.size()) batchBuffers.push_back(new uint8_t[frameSizeInBytes]);
+            takeReadyFrame(batchBuffers[copiedFrames]);
+            frames.push_back(batchBuffers[copiedFrames++]);
+        }
+    }
+    return frames;
+}
 
+// Copies the oldest ready frame into destination, rows padded to a multiple of 32 pixels like the rest of VideoDecoder.
+bool VideoDecoder::takeReadyFrame(uint8_t *destination) {
+    if (!fillReadyFrames(1)) return false;
+
+    AVFrame *pReadyFrame = readyFrames.front();
+    readyFrames.pop_front();
+    {
+        TRACE_SCOPE("copy");
+        int lineSize = (width+padCount) * 4;
+        if (pReadyFrame->linesize[0] == lineSize) {
+            std::copy(pReadyFrame->data[0], pReadyFrame->data[0]+frameSizeInBytes, destination);
+        } else {
+            for (int row = 0; row < height; row++) {
+                std::copy(pReadyFrame->data[0] + row*pReadyFrame->linesize[0], pReadyFrame->data[0] + row*pReadyFrame->linesize[0] + width*4, destination + row*lineSize);
+            }
+        }
+    }
+    frameTaken(pReadyFrame);
+    av_frame_unref(pReadyFrame);
+    spareFrames.push_back(pReadyFrame);
+    return true;
+}
 
+// Bookkeeping for a frame leaving the ready queue
+void VideoDecoder::frameTaken(AVFrame *pReadyFrame) {
+    lastFramePts = pReadyFrame->pts;
+    lastDemuxWaitTime = demuxWaitTime;
+    demuxWaitTime = 0;
+    lastDroppedFrameCount = droppedFrameCount;
+    droppedFrameCount = 0;
+    frameCount++;
+}
 
-    while (av_read_frame(pFormatContext, pAVPacket) <= 0) {
+// Gives the frames handed out in place by the last readFrames back to the spare list
+void VideoDecoder::releaseHeldFrames() {
+    for (size_t i = 0; i < heldFrames.size(); i++) {
+        av_frame_unref(heldFrames[i]);
+        spareFrames.push_back(heldFrames[i]);
+    }
+    heldFrames.clear();
+}
+
+// Runs demuxer -> decoder -> filter graph until at least minimumFrames filtered frames are ready.
+// At the end of the input the decoder and then the filter graph are flushed, so no buffered frame is lost.
+// Returns false once everything has been drained.
+bool VideoDecoder::fillReadyFrames(size_t minimumFrames) {
+    while (readyFrames.size() < minimumFrames) {
+        if (filterEOF) return !readyFrames.empty();
+
+        if (decoderEOF) {
+            TRACE_SCOPE("filter_push");
+            if (av_buffersrc_add_frame_flags(pBufferSrcContext, NULL, 0) < 0) std::cout << "Flushing pBufferSrc failed" << std::endl;
+            pullFilteredFrames();
+            filterEOF = true;
+            continue;
+        }
+
+        // The decoder may hold several frames (B-frames, frame threading). Take all of them before sending more.
+        result = receiveDecodedFrames();
+        if (readyFrames.size() >= minimumFrames || decoderEOF) continue;
+        if (demuxerEOF) {
+            // Decoder was flushed but didn't report EOF (flush rejected or decode error), nothing more will come out
+            decoderEOF = true;
+            continue;
+        }
+        sendNextPacket();
+    }
+    return true;
+}
+
+// Sends the next video packet to the decoder, or the flush packet once the demuxer is done.
+void VideoDecoder::sendNextPacket() {
+    if (demuxerEOF) return;
+    while (true) {
+        int readResult;
+        {
+            TRACE_SCOPE("demux");
+            auto demuxStart = std::chrono::steady_clock::now();
+            readResult = av_read_frame(pFormatContext, pAVPacket);
+            demuxWaitTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - demuxStart).count();
+        }
+        if (readResult < 0) {
+            if (readResult != AVERROR_EOF) printf("av_read_frame error: %s\n", av_err2str(readResult));
+            demuxerEOF = true;
+            TRACE_SCOPE("decode");
+            avcodec_send_packet(pCodecContext, NULL);
+            return;
+        }
         if (pAVPacket->stream_index != videoStreamIndex) {
             av_packet_unref(pAVPacket);
             continue;
         }
 
-        // Send the data packet to the decoder
+        TRACE_SCOPE("decode");
+        // Non-reference frames that are already too late aren't decoded at all. Decided per packet, so an on-time
+        // frame is never skipped. Such frames never come out of the decoder, they are counted in countSkippedFrames.
+        bool isSkippable = isDropping && pAVPacket->pts != AV_NOPTS_VALUE && ptsToSeconds(pAVPacket->pts) < dropBeforeTimestamp;
+        pCodecContext->skip_frame = isSkippable ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+        if (isSkippable) skippablePts.insert(pAVPacket->pts);
+        // Send the data packet to the decoder. EAGAIN can't happen since the decoder is always drained first.
         int sendPacketResult = avcodec_send_packet(pCodecContext, pAVPacket);
         if (sendPacketResult == AVERROR(EAGAIN)){
             std::cerr << "Decoder can't take packets right now. Make sure you are draining it." << std::endl;
-        }else if (sendPacketResult < AVERROR(ENOMEM)){
+        }else if (sendPacketResult < 0){
             std::cerr << "Failed to send the packet to the decoder!" << std::endl;
         }
-        // Receive decoded frame
-        result = avcodec_receive_frame(pCodecContext, pFrame);
-        if (result == AVERROR(EAGAIN)) {
-            av_packet_unref(pAVPacket);
-            continue;
-        } else if (result == AVERROR_EOF) {
-            std::cout << "Finished reading file" << std::endl;
-        } else if (result < 0) {
+        av_packet_unref(pAVPacket);
+        return;
+    }
+}
+
+// Receives every frame the decoder has ready and pushes each one through the filter graph.
+// Returns the avcodec_receive_frame result that ended the loop.
+int VideoDecoder::receiveDecodedFrames() {
+    while (true) {
+        int receiveResult;
+        {
+            TRACE_SCOPE("decode");
+            receiveResult = avcodec_receive_frame(pCodecContext, pFrame);
+        }
+        if (receiveResult == AVERROR(EAGAIN)) {
+            return receiveResult;
+        } else if (receiveResult == AVERROR_EOF) {
+            decoderEOF = true;
+            countSkippedFrames(INT64_MAX);
+            return receiveResult;
+        } else if (receiveResult < 0) {
             std::cout << "No frame was received from decoder!" << std::endl;
-            printf("avcodec_receive_frame error: %s\n", av_err2str(result));
+            printf("avcodec_receive_frame error: %s\n", av_err2str(receiveResult));
+            return receiveResult;
         }
-        av_packet_unref(pAVPacket);
-        break;
+
+        pFrame->pts = pFrame->best_effort_timestamp;
+        countSkippedFrames(pFrame->pts);
+        if (shouldDropFrame(pFrame)) {
+            av_frame_unref(pFrame);
+            continue;
+        }
+        {
+            TRACE_SCOPE("filter_push");
+            // Without KEEP_REF the buffer source takes over pFrame's references and resets it
+            if (av_buffersrc_add_frame_flags(pBufferSrcContext, pFrame, 0) < 0) std::cout << "Pushing to pBufferSrc failed" << std::endl;
+        }
+        av_frame_unref(pFrame);
+        pullFilteredFrames();
     }
+}
 
-    if (av_buffersrc_add_frame_flags(pBufferSrcContext, pFrame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) std::cout << "Pushing to pBufferSrc failed" << std::endl;
+void VideoDecoder::pullFilteredFrames() {
+    TRACE_SCOPE("filter_pull");
     while (true) {
-        int ret = av_buffersink_get_frame(pBufferSinkContext, pRGBFrame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            break;
-        if (ret < 0)
-            std::cout << "Receive from pBufferSink failed" << std::endl;
-    }
-    av_frame_unref(pFrame);
-    av_packet_unref(pAVPacket);
-    //for (int i = 0; i < frameSizeInBytes/4096; i+=4) std::cout << (int)pRGBFrame->data[0][i+2];
-    std::copy(pRGBFrame->data[0], pRGBFrame->data[0]+frameSizeInBytes-1, resultBuffer);
-    av_frame_unref(pRGBFrame);
-    return resultBuffer;
+        AVFrame *pFilteredFrame;
+        if (spareFrames.empty()) {
+            pFilteredFrame = av_frame_alloc();
+        } else {
+            pFilteredFrame = spareFrames.back();
+            spareFrames.pop_back();
+        }
+        int ret = av_buffersink_get_frame(pBufferSinkContext, pFilteredFrame);
+        if (ret < 0) {
+            spareFrames.push_back(pFilteredFrame);
+            if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) std::cout << "Receive from pBufferSink failed" << std::endl;
+            return;
+        }
+        readyFrames.push_back(pFilteredFrame);
+    }
+}
 
+// Drops everything queued in the decoder and filter graph, e.g. after seeking.
+void VideoDecoder::resetDecodeState() {
+    avcodec_flush_buffers(pCodecContext);
+    while (!readyFrames.empty()) {
+        av_frame_unref(readyFrames.front());
+        spareFrames.push_back(readyFrames.front());
+        readyFrames.pop_front();
+    }
+    if (filterEOF) {
+        // A flushed filter graph doesn't accept new frames
+        avfilter_graph_free(&pFilterGraph);
+        initializeFilters();
+    }
+    demuxerEOF = false;
+    decoderEOF = false;
+    filterEOF = false;
+    isDropping = false;
+    skippablePts.clear();
+    pCodecContext->skip_frame = AVDISCARD_DEFAULT;
+}
+
+void VideoDecoder::dropFramesBefore(double timestamp) {
+    isDropping = true;
+    dropBeforeTimestamp = timestamp;
+}
+
+// Stops dropping at the first frame that is new enough. Frames without a timestamp are never dropped.
+bool VideoDecoder::shouldDropFrame(AVFrame *pDecodedFrame) {
+    if (!isDropping) return false;
+    if (pDecodedFrame->pts != AV_NOPTS_VALUE && ptsToSeconds(pDecodedFrame->pts) < dropBeforeTimestamp) {
+        droppedFrameCount++;
+        return true;
+    }
+    isDropping = false;
+    return false;
+}
+
+// Frames come out of the decoder in presentation order, so once a frame with this pts is out, every skippable
+// packet before it that hasn't produced a frame was skipped by the decoder.
+void VideoDecoder::countSkippedFrames(int64_t pts) {
+    if (skippablePts.empty() || pts == AV_NOPTS_VALUE) return;
+    std::set<int64_t>::iterator skippedEnd = skippablePts.lower_bound(pts);
+    droppedFrameCount += std::distance(skippablePts.begin(), skippedEnd);
+    skippablePts.erase(skippablePts.begin(), skippedEnd);
+    skippablePts.erase(pts);
+}
+
+double VideoDecoder::ptsToSeconds(int64_t pts) {
+    return (pts - streamStartTime) * av_q2d(streamTimeBase);
 }
 
 
@@ -230,13 +462,30 @@ uint8_t* VideoDecoder::readFrame() {
 bool VideoDecoder::seekFrame(int frameNumber) {
 
     int result = av_seek_frame(pFormatContext, videoStreamIndex, frameNumber, NULL);
+    resetDecodeState();
     //std::cout << "seekFrame: " << result << std::endl;
     return true;
 
 }
 
+// Presentation time of the last frame returned, in seconds from the start of the stream.
+// Falls back to counting frames when the stream has no timestamps.
+double VideoDecoder::getFrameTimestamp() {
+    if (lastFramePts == AV_NOPTS_VALUE) return (frameCount - 1) / av_q2d(streamFrameRate);
+    return ptsToSeconds(lastFramePts);
+}
+
 void VideoDecoder::printVideoInfo() {
     av_dump_format(pFormatContext, 0, inputFileName.c_str(), 0);
+    printIOStats();
+}
+
+void VideoDecoder::printIOStats() {
+    if (pReadAheadIO != NULL) {
+        pReadAheadIO->printIOStats();
+    } else {
+        std::cout << "I/O mode: libavformat default" << std::endl;
+    }
 }
 
 
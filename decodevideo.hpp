@@ -5,6 +5,12 @@
 #include <fstream>
 #include <string>
 #include <algorithm>
+#include <vector>
+#include <deque>
+#include <set>
+#include <chrono>
+#include "trace.hpp"
+#include "readaheadio.hpp"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -41,7 +47,8 @@ int writePal8PPM(std::string outputFileName, int width, int height, uint8_t *dat
 class VideoDecoder {
 
 public:
-    VideoDecoder(int width, int height, std::string inputFileName) {
+    // ioOptions selects how the input file is read, see readaheadio.hpp. The default is libavformat's own file I/O.
+    VideoDecoder(int width, int height, std::string inputFileName, IOOptions ioOptions = IOOptions()) {
 
         frameCount = 0;
         padCount = (32-(width%32))%32;
@@ -51,6 +58,8 @@ public:
         this->width = width;
         this->height = height;
         this->inputFileName = inputFileName;
+        this->ioOptions = ioOptions;
+        pReadAheadIO = NULL;
         filterDescription = std::string("scale=w=") + std::to_string(width) + ":h=" + std::to_string(height) + ":flags=bicubic,format=pix_fmts=" + av_get_pix_fmt_name(AV_PIX_FMT_RGB24);
 
 
@@ -59,30 +68,52 @@ public:
         initializeFilters();
         pAVPacket = av_packet_alloc();
         pFrame = av_frame_alloc();
-        pRGBFrame = av_frame_alloc();
-        RGBBuffer = new uint8_t[frameSizeInBytes];
-        av_image_fill_arrays(pRGBFrame->data, pRGBFrame->linesize, RGBBuffer, AV_PIX_FMT_BGRA, width, height, 32);
+        demuxerEOF = false;
+        decoderEOF = false;
+        filterEOF = false;
         frameBuffer = new uint8_t[frameSizeInBytes];
         av_image_fill_arrays(pFrame->data, pFrame->linesize, frameBuffer, pCodecContext->pix_fmt, pCodecContext->width, pCodecContext->height, 32);
 
-        frameRate = (int)av_q2d(pFormatContext->streams[videoStreamIndex]->avg_frame_rate);
+        frameRate = (int)av_q2d(streamFrameRate);
+        lastFramePts = AV_NOPTS_VALUE;
+        demuxWaitTime = 0;
+        lastDemuxWaitTime = 0;
+        isDropping = false;
+        dropBeforeTimestamp = 0;
+        droppedFrameCount = 0;
+        lastDroppedFrameCount = 0;
     }
 
     ~VideoDecoder() {
         // Free up used resources
 
         av_frame_free(&pFrame);
-        av_frame_free(&pRGBFrame);
+        for (size_t i = 0; i < readyFrames.size(); i++) av_frame_free(&readyFrames[i]);
+        for (size_t i = 0; i < spareFrames.size(); i++) av_frame_free(&spareFrames[i]);
+        for (size_t i = 0; i < heldFrames.size(); i++) av_frame_free(&heldFrames[i]);
+        for (size_t i = 0; i < batchBuffers.size(); i++) delete[] batchBuffers[i];
         av_packet_free(&pAVPacket);
         delete[] frameBuffer;
-        delete[] RGBBuffer;
         delete[] resultBuffer;
         avformat_close_input(&pFormatContext);
+        delete pReadAheadIO; // Custom AVIOContext is not freed by avformat_close_input
     }
 
     uint8_t *readFrame();
+    std::vector<uint8_t*> readFrames(int numberOfFrames);
     bool seekFrame(int frameNumber);
     void printVideoInfo();
+    void printIOStats();
+    double getFrameTimestamp();
+    double getFrameRate() { return av_q2d(streamFrameRate); }
+    // Seconds spent in av_read_frame while producing the last frame returned. On a live pipe this is the time spent waiting on the source.
+    double getDemuxWaitTime() { return lastDemuxWaitTime; }
+    // Frames with a timestamp before this are thrown away right after decoding, without scaling or copying, and
+    // non-reference ones aren't decoded at all. Dropping stops at the first frame that is new enough.
+    // Lets a live pipeline that fell behind catch up.
+    void dropFramesBefore(double timestamp);
+    // Frames dropped between the previous frame returned and the last one
+    int getDroppedFrameCount() { return lastDroppedFrameCount; }
 
 
 private:
@@ -93,6 +124,8 @@ private:
     int width;
     int height;
     std::string inputFileName;
+    IOOptions ioOptions;
+    ReadAheadIO * pReadAheadIO;
 
 
 
@@ -103,12 +136,30 @@ private:
     int result;
     AVPacket * pAVPacket;
     AVFrame * pFrame;
-    AVFrame * pRGBFrame;
     int scaledBufferByteCount;
     int frameRate;
+    AVRational streamFrameRate;
+    AVRational streamTimeBase;
+    int64_t streamStartTime;
+    int64_t lastFramePts;
+    double demuxWaitTime;     // Accumulated since the last frame was returned
+    double lastDemuxWaitTime;
+    bool isDropping;
+    double dropBeforeTimestamp;
+    std::set<int64_t> skippablePts; // Packets sent with AVDISCARD_NONREF whose frame hasn't come out yet
+    int droppedFrameCount;          // Accumulated since the last frame was returned
+    int lastDroppedFrameCount;
     uint8_t * resultBuffer;
     uint8_t * frameBuffer;
-    uint8_t * RGBBuffer;
+
+    // Filtered frames waiting to be returned, and emptied frames kept for reuse
+    std::deque<AVFrame*> readyFrames;
+    std::vector<AVFrame*> spareFrames;
+    std::vector<AVFrame*> heldFrames;    // Handed out in place by readFrames
+    std::vector<uint8_t*> batchBuffers;
+    bool demuxerEOF;
+    bool decoderEOF;
+    bool filterEOF;
 
 
     AVFilterContext * pBufferSinkContext;
@@ -121,6 +172,17 @@ private:
 
     int openInputFile();
     int initializeFilters();
+    bool takeReadyFrame(uint8_t *destination);
+    void frameTaken(AVFrame *pReadyFrame);
+    void releaseHeldFrames();
+    bool fillReadyFrames(size_t minimumFrames);
+    void sendNextPacket();
+    int receiveDecodedFrames();
+    void pullFilteredFrames();
+    void resetDecodeState();
+    bool shouldDropFrame(AVFrame *pDecodedFrame);
+    void countSkippedFrames(int64_t pts);
+    double ptsToSeconds(int64_t pts);
 
 };
 
@@ -1,9 +1,41 @@
 #include "fastpixelmap.hpp"
 
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 using namespace std;
 
 int PIXEL_SIZE_IN_BYTES = 4;
 
+// LUT file: header followed by the payload laid out by assignLUTs. Integers are stored in host byte order,
+// a file from a machine with different endianness fails the checksum and is rebuilt.
+static const char LUT_FILE_MAGIC[8] = {'F','P','M','L','U','T','\0','\0'};
+static const uint32_t LUT_FILE_VERSION = 2; // 2: whole palette is sorted
+struct LUTFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t paletteSize;
+    uint64_t paletteHash;
+    uint64_t payloadSize;
+    uint64_t payloadChecksum;
+    uint8_t reserved[24]; // Keeps the payload 64 byte aligned in the mapping
+};
+
+// 64-bit FNV-1a
+static uint64_t fnv1a(const uint8_t *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 bool BGRAcmp(const BGRAPixel &a, const BGRAPixel &b) {
     int meanA = ((int)a.red+a.green+a.blue)/3;
     int meanB = ((int)b.red+b.green+b.blue)/3;
@@ -23,7 +55,15 @@ int displayPalette(uint8_t *palette, int paletteSize) {
 }
 
 
+FastPixelMap::~FastPixelMap() {
+
+    if (mappedLUTFile != NULL) munmap(mappedLUTFile, mappedLUTFileSize);
+    delete[] lutStorage;
+
+}
+
 uint8_t* FastPixelMap::fullSearchConvertImage(uint8_t *image, int imageWidth, int imageHeight, bool isPadded) {
+    TRACE_SCOPE("map_full_search");
 
     uint8_t* pal8Image = new uint8_t[imageWidth * imageHeight];
 
@@ -61,6 +101,7 @@ uint8_t* FastPixelMap::fullSearchConvertImage(uint8_t *image, int imageWidth, in
 // imageWidth is number of pixels per row. FFMPEG pads rows with excess space in order to make sure
 // the linesize is divisible by 32.
 uint8_t* FastPixelMap::convertImage(uint8_t *image, int imageWidth, int imageHeight, bool isPadded) {
+    TRACE_SCOPE("map");
 
     uint8_t* pal8Image = new uint8_t[imageWidth * imageHeight];
 
@@ -155,11 +196,139 @@ uint8_t* FastPixelMap::convertImage(uint8_t *image, int imageWidth, int imageHei
             pal8Image[heightIndex*imageWidth+widthIndex/PIXEL_SIZE_IN_BYTES] = indexMin;
         }
     }
-    displayPalette(palette, paletteSize);
 
     return pal8Image;
 }
 
+// Same search as convertImage with two early exits:
+// - Any color c has sed >= (sum of pixel channels - sum of c's channels)^2 / 3. Because the palette is sorted by mean,
+//   the colors past index k (in either direction) can't have a channel sum closer to the pixel's than 3 * mean(k)
+//   (+2 for the rounding of the mean going up). A direction stops once that bound exceeds sedMin - tolerance, which
+//   proves sedMin is within tolerance of the optimum. convertImage uses the candidate's own ssd instead, which is
+//   faster but can stop too early while the candidates are still on the near side of the pixel's mean.
+// - After maxCandidates colors have been looked at, the best so far is used without any guarantee.
+uint8_t* FastPixelMap::approximateConvertImage(uint8_t *image, int imageWidth, int imageHeight, bool isPadded, int tolerance, int maxCandidates) {
+    TRACE_SCOPE("map_approximate");
+
+    uint8_t* pal8Image = new uint8_t[imageWidth * imageHeight];
+    if (tolerance < 0) tolerance = 0;
+    if (maxCandidates < 1) maxCandidates = 1;
+
+    int padCount = (32-(imageWidth%32))%32; // padCount in terms of pixels
+    for (int heightIndex = 0; heightIndex < imageHeight; heightIndex++) {
+        for (int widthIndex = 0; widthIndex < imageWidth*PIXEL_SIZE_IN_BYTES; widthIndex+=PIXEL_SIZE_IN_BYTES) {
+
+            int offset;
+            if (isPadded) {
+                offset = (imageWidth+padCount)*heightIndex*PIXEL_SIZE_IN_BYTES + widthIndex;
+            } else {
+                offset = imageWidth*heightIndex*PIXEL_SIZE_IN_BYTES + widthIndex;
+            }
+
+            int predIndex = indexLUT[meanValue(image + offset)];
+            int pixelSum = image[offset] + image[offset+1] + image[offset+2];
+
+            int sedMin = sed(image + offset, palette + predIndex*PIXEL_SIZE_IN_BYTES);
+            int indexMin = predIndex;
+            int candidates = 1;
+
+            int downIndex = indexMin;
+            int upIndex = indexMin;
+
+            bool down = (indexMin >= paletteSize-1) ? false : true;
+            bool up = (indexMin <= 0) ? false : true;
+            while ((up || down) && candidates < maxCandidates) {
+
+                if (down) {
+                    downIndex++;
+                    if ( downIndex >= paletteSize ) {
+                        down = false;
+                    } else if ( (3 * (sedMin - tolerance)) < squaresLUT[max(0, 3*meanPaletteLUT[downIndex] - pixelSum)] )  {
+                        down = false;
+                    } else if ( (4 * sedMin) < paletteDistanceLUT[indexMin*paletteSize + downIndex] ) {
+                        // This color is rejected using the triangular inequality rule
+                        candidates++;
+                    } else {
+                        candidates++;
+                        int testSed = squaresLUT[abs(image[offset] - palette[downIndex*4])];
+                        if (testSed < sedMin) {
+                            testSed += squaresLUT[abs(image[offset+1] - palette[downIndex*4+1])];
+                            if (testSed < sedMin) {
+                                testSed += squaresLUT[abs(image[offset+2] - palette[downIndex*4+2])];
+                                if (testSed < sedMin) {
+                                    sedMin = testSed;
+                                    indexMin = downIndex;
+                                }
+                            }
+                        }
+                    }
+                }
+
+                if (up && candidates < maxCandidates) {
+                    upIndex--;
+                    if ( upIndex < 0 ) {
+                        up = false;
+                    } else if ( (3 * (sedMin - tolerance)) < squaresLUT[max(0, pixelSum - 3*meanPaletteLUT[upIndex] - 2)] ) {
+                        up = false;
+                    } else if ( (4 * sedMin) < paletteDistanceLUT[indexMin*paletteSize + upIndex] ) {
+                        // This color is rejected using the triangular inequality rule
+                        candidates++;
+                    } else {
+                        candidates++;
+                        int testSed = squaresLUT[abs(image[offset] - palette[upIndex*4])];
+                        if (testSed < sedMin) {
+                            testSed += squaresLUT[abs(image[offset+1] - palette[upIndex*4+1])];
+                            if (testSed < sedMin) {
+                                testSed += squaresLUT[abs(image[offset+2] - palette[upIndex*4+2])];
+                                if (testSed < sedMin) {
+                                    sedMin = testSed;
+                                    indexMin = upIndex;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+            pal8Image[heightIndex*imageWidth+widthIndex/PIXEL_SIZE_IN_BYTES] = indexMin;
+        }
+    }
+
+    return pal8Image;
+}
+
+// Compares pal8Image (made by this mapper from image) against fullSearchConvertImage.
+MappingError FastPixelMap::measureMappingError(uint8_t *image, int imageWidth, int imageHeight, bool isPadded, uint8_t *pal8Image) {
+    uint8_t *optimalImage = fullSearchConvertImage(image, imageWidth, imageHeight, isPadded);
+
+    long long totalSed = 0;
+    long long totalOptimalSed = 0;
+    int maxExcessSed = 0;
+    int mismatchCount = 0;
+    int padCount = (32-(imageWidth%32))%32;
+    for (int heightIndex = 0; heightIndex < imageHeight; heightIndex++) {
+        for (int widthIndex = 0; widthIndex < imageWidth; widthIndex++) {
+            int offset = ((isPadded ? imageWidth+padCount : imageWidth)*heightIndex + widthIndex) * PIXEL_SIZE_IN_BYTES;
+            int pixelIndex = heightIndex*imageWidth + widthIndex;
+            int pixelSed = sed(image + offset, palette + pal8Image[pixelIndex]*PIXEL_SIZE_IN_BYTES);
+            int optimalSed = sed(image + offset, palette + optimalImage[pixelIndex]*PIXEL_SIZE_IN_BYTES);
+            totalSed += pixelSed;
+            totalOptimalSed += optimalSed;
+            if (pixelSed - optimalSed > maxExcessSed) maxExcessSed = pixelSed - optimalSed;
+            if (pixelSed != optimalSed) mismatchCount++;
+        }
+    }
+    delete[] optimalImage;
+
+    int pixelCount = imageWidth * imageHeight;
+    MappingError error;
+    error.meanSed = (double)totalSed / pixelCount;
+    error.meanOptimalSed = (double)totalOptimalSed / pixelCount;
+    error.meanExcessSed = error.meanSed - error.meanOptimalSed;
+    error.maxExcessSed = maxExcessSed;
+    error.mismatchFraction = (double)mismatchCount / pixelCount;
+    return error;
+}
+
 bool FastPixelMap::initializeMeanPaletteLUT() {
 
     for (int i = 0; i < paletteSize*PIXEL_SIZE_IN_BYTES; i+=PIXEL_SIZE_IN_BYTES) {
@@ -217,6 +386,86 @@ int FastPixelMap::meanValue(uint8_t *color) {
     return (color[0] + color[1] + color[2]) / 3;
 }
 
+uint64_t FastPixelMap::hashPalette() {
+    return fnv1a(palette, paletteSize*PIXEL_SIZE_IN_BYTES);
+}
+
+std::string FastPixelMap::getLUTFileName() {
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "fastpixelmap-%016llx-%d.lut", (unsigned long long)paletteHash, paletteSize);
+    return fileName;
+}
+
+// Payload layout: squaresLUT (768 ints), paletteDistanceLUT (paletteSize^2 ints), sorted palette (paletteSize BGRA),
+// indexLUT (256 bytes), meanPaletteLUT (paletteSize bytes). Int tables first so they stay aligned.
+size_t FastPixelMap::getLUTPayloadSize() {
+    return 768*sizeof(int) + (size_t)paletteSize*paletteSize*sizeof(int) + paletteSize*PIXEL_SIZE_IN_BYTES + 256 + paletteSize;
+}
 
+void FastPixelMap::assignLUTs(uint8_t *payload) {
+    squaresLUT = (int*)payload;
+    paletteDistanceLUT = squaresLUT + 768;
+    uint8_t *sortedPalette = (uint8_t*)(paletteDistanceLUT + paletteSize*paletteSize);
+    indexLUT = sortedPalette + paletteSize*PIXEL_SIZE_IN_BYTES;
+    meanPaletteLUT = indexLUT + 256;
+}
+
+bool FastPixelMap::loadLUTFile(std::string lutFileName) {
+    int fileDescriptor = open(lutFileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) return false; // Not built yet
+    struct stat fileInfo;
+    size_t expectedSize = sizeof(LUTFileHeader) + getLUTPayloadSize();
+    if (fstat(fileDescriptor, &fileInfo) != 0 || (size_t)fileInfo.st_size != expectedSize) {
+        close(fileDescriptor);
+        return false;
+    }
+    // Shared and read-only, so every process mapping this file uses the same page cache pages
+    void *mapping = mmap(NULL, expectedSize, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (mapping == MAP_FAILED) return false;
+
+    uint8_t *fileData = (uint8_t*)mapping;
+    LUTFileHeader header;
+    memcpy(&header, fileData, sizeof(header));
+    uint8_t *payload = fileData + sizeof(LUTFileHeader);
+    if (memcmp(header.magic, LUT_FILE_MAGIC, 8) != 0 || header.version != LUT_FILE_VERSION || header.paletteSize != (uint32_t)paletteSize
+        || header.paletteHash != paletteHash || header.payloadSize != getLUTPayloadSize() || header.payloadChecksum != fnv1a(payload, header.payloadSize)) {
+        cerr << "Ignoring stale or corrupt LUT file " << lutFileName << endl;
+        munmap(mapping, expectedSize);
+        return false;
+    }
 
+    mappedLUTFile = fileData;
+    mappedLUTFileSize = expectedSize;
+    assignLUTs(payload);
+    // The caller's palette has to end up sorted the same way as when the tables were built
+    memcpy(palette, payload + 768*sizeof(int) + (size_t)paletteSize*paletteSize*sizeof(int), paletteSize*PIXEL_SIZE_IN_BYTES);
+    return true;
+}
 
+// Writes to a temporary file and renames it into place, so concurrent workers never map a half written file.
+bool FastPixelMap::saveLUTFile(std::string lutFileName) {
+    uint8_t *sortedPalette = (uint8_t*)(paletteDistanceLUT + paletteSize*paletteSize);
+    memcpy(sortedPalette, palette, paletteSize*PIXEL_SIZE_IN_BYTES);
+
+    LUTFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LUT_FILE_MAGIC, 8);
+    header.version = LUT_FILE_VERSION;
+    header.paletteSize = paletteSize;
+    header.paletteHash = paletteHash;
+    header.payloadSize = getLUTPayloadSize();
+    header.payloadChecksum = fnv1a(lutStorage, header.payloadSize);
+
+    std::string temporaryFileName = lutFileName + "." + to_string(getpid()) + ".tmp";
+    fstream lutFile(temporaryFileName, ios::out | ios::trunc | ios::binary);
+    if (!lutFile.is_open()) return false;
+    lutFile.write((char*)&header, sizeof(header));
+    lutFile.write((char*)lutStorage, header.payloadSize);
+    lutFile.close();
+    if (!lutFile.good() || rename(temporaryFileName.c_str(), lutFileName.c_str()) != 0) {
+        remove(temporaryFileName.c_str());
+        return false;
+    }
+    return true;
+}
@@ -2,6 +2,9 @@
 #define FASTPIXELMAP_HPP_INCLUDED
 #include <iostream>
 #include <algorithm>
+#include <string>
+#include <cstdint>
+#include "trace.hpp"
 
 struct BGRAPixel {
     uint8_t blue;
@@ -17,52 +20,88 @@ int displayPalette(uint8_t *palette, int paletteSize);
 
 
 
+// Quality of a pal8 image compared to the exact nearest colors found by fullSearchConvertImage.
+// Errors are squared euclidean distances (sed) in 8-bit RGB.
+struct MappingError {
+    double meanSed;          // Mean error of the checked image
+    double meanOptimalSed;   // Mean error of the full search result
+    double meanExcessSed;    // meanSed - meanOptimalSed
+    int maxExcessSed;        // Largest per pixel difference to the optimum
+    double mismatchFraction; // Fraction of pixels not mapped to the nearest color (ties count as matches)
+};
+
 // Converts BGRA image into pal8 using accelerated pixel mapping algorithm by Yu-Chen Hu and B.-H Su
 // Stores pal8 image in "image"
 // Sorts palette by ascending mean value
 // paletteSize is number of colors in palette, not number of bytes associated with *palette
+// If lutCacheDirectory is given, the sorted palette and lookup tables are saved there as a file keyed by a hash of the
+// palette. Later instances with the same palette mmap that file read-only instead of rebuilding the tables, so all
+// processes on a host share one copy through the page cache.
 class FastPixelMap {
 
 public:
-    FastPixelMap(uint8_t *palette, int paletteSize) {
+    FastPixelMap(uint8_t *palette, int paletteSize, std::string lutCacheDirectory = "") {
         this->palette = palette;
         this->paletteSize = paletteSize;
-        // (1) Sort palette by mean value
-        std::sort((BGRAPixel*) palette, (BGRAPixel*) palette+paletteSize-1, BGRAcmp);
-        meanPaletteLUT = new uint8_t[paletteSize];
-        if (!initializeMeanPaletteLUT()) std::cerr << "Failed to initialize Mean Palette LUT" << std::endl;
-        if (!initializeIndexLUT()) std::cerr << "Failed to initialize Index LUT or your palette does not have white as a color!" << std::endl;
-        for (int i = 0; i < 768; i++) { // initialize squaresLUT
-            squaresLUT[i] = i * i;
+        lutStorage = NULL;
+        mappedLUTFile = NULL;
+        mappedLUTFileSize = 0;
+        paletteHash = hashPalette(); // Before sorting, so the key matches the palette the caller passes in
+
+        std::string lutFileName = lutCacheDirectory.empty() ? "" : lutCacheDirectory + "/" + getLUTFileName();
+        if (lutFileName.empty() || !loadLUTFile(lutFileName)) {
+            // (1) Sort palette by mean value
+            std::sort((BGRAPixel*) palette, (BGRAPixel*) palette+paletteSize, BGRAcmp);
+            lutStorage = new uint8_t[getLUTPayloadSize()];
+            assignLUTs(lutStorage);
+            if (!initializeMeanPaletteLUT()) std::cerr << "Failed to initialize Mean Palette LUT" << std::endl;
+            if (!initializeIndexLUT()) std::cerr << "Failed to initialize Index LUT or your palette does not have white as a color!" << std::endl;
+            for (int i = 0; i < 768; i++) { // initialize squaresLUT
+                squaresLUT[i] = i * i;
+            }
+            if (!initializePaletteDistanceLUT()) std::cerr << "Failed to initialize Palette Distance LUT!" << std::endl;
+            if (!lutFileName.empty() && !saveLUTFile(lutFileName)) std::cerr << "Failed to save LUT file " << lutFileName << std::endl;
         }
-        paletteDistanceLUT = new int[paletteSize*paletteSize];
-        if (!initializePaletteDistanceLUT()) std::cerr << "Failed to initialize Palette Distance LUT!" << std::endl;
     }
     uint8_t* convertImage(uint8_t *image, int imageWidth, int imageHeight, bool isPadded);
     uint8_t* fullSearchConvertImage(uint8_t *image, int imageWidth, int imageHeight, bool isPadded);
+    // Approximate mapping for previews. Each pixel's color is at most tolerance (sed) worse than the nearest color,
+    // unless the search is cut off after maxCandidates palette colors. tolerance = 0 and maxCandidates >= paletteSize
+    // gives the nearest color, like fullSearchConvertImage.
+    uint8_t* approximateConvertImage(uint8_t *image, int imageWidth, int imageHeight, bool isPadded, int tolerance, int maxCandidates);
+    MappingError measureMappingError(uint8_t *image, int imageWidth, int imageHeight, bool isPadded, uint8_t *pal8Image);
+    bool isUsingLUTFile() { return mappedLUTFile != NULL; }
 
-    ~FastPixelMap() {
-
-        delete[] meanPaletteLUT;
-        delete[] paletteDistanceLUT;
-
-    }
+    ~FastPixelMap();
 
 private:
     uint8_t *palette;
     int paletteSize;
 
+    // All lookup tables live in one block, either lutStorage or the mmap'ed LUT file
+    uint8_t *lutStorage;
+    uint8_t *mappedLUTFile;
+    size_t mappedLUTFileSize;
+    uint64_t paletteHash;
+
     uint8_t *meanPaletteLUT;
     bool initializeMeanPaletteLUT();
 
-    uint8_t indexLUT[256];
+    uint8_t *indexLUT; // 256 entries
     bool initializeIndexLUT();
 
-    int squaresLUT[768];
+    int *squaresLUT; // 768 entries
 
     int *paletteDistanceLUT;
     bool initializePaletteDistanceLUT();
 
+    uint64_t hashPalette();
+    std::string getLUTFileName();
+    size_t getLUTPayloadSize();
+    void assignLUTs(uint8_t *payload);
+    bool loadLUTFile(std::string lutFileName);
+    bool saveLUTFile(std::string lutFileName);
+
     int sed(uint8_t *colorA, uint8_t *colorB);
     int ssd(uint8_t *colorA, uint8_t *colorB);
     int meanValue(uint8_t *color);
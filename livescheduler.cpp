@@ -0,0 +1,87 @@
+#include "livescheduler.hpp"
+
+#include <algorithm>
+
+static const double COST_SMOOTHING = 0.2; // Weight of the newest sample in the cost moving averages
+static const double COST_DECAY = 0.98;    // Unused engines look a little cheaper every frame, so they get retried after a spike
+
+
+// timestamp is the frame's presentation time in seconds (VideoDecoder::getFrameTimestamp).
+// sourceWaitTime is how long reading its data blocked on the input (VideoDecoder::getDemuxWaitTime).
+// framesDropped is how many frames the decoder dropped since the previous one (VideoDecoder::getDroppedFrameCount).
+FrameAction LiveScheduler::frameReady(double timestamp, double sourceWaitTime, int framesDropped) {
+    double arrivalTime = now();
+
+    if (!isAnchored) {
+        anchorTime = arrivalTime;
+        firstTimestamp = timestamp;
+        isAnchored = true;
+    } else if (timestamp > lastTimestamp) {
+        // The dropped frames were spread over the gap since the last frame
+        double delta = (timestamp - lastTimestamp) / (framesDropped + 1);
+        frameInterval = (frameInterval == 0) ? delta : (1 - COST_SMOOTHING) * frameInterval + COST_SMOOTHING * delta;
+    }
+    droppedFrames += framesDropped;
+    lastTimestamp = timestamp;
+    presentationTime = anchorTime + (timestamp - firstTimestamp);
+
+    // Late, but the demuxer blocked on the input: the source fell behind, not the pipeline. When the pipeline is behind,
+    // data is already queued in the pipe and the demuxer doesn't wait. Only the wait itself is forgiven.
+    if (frameInterval > 0 && arrivalTime - presentationTime > frameInterval / 2 && sourceWaitTime > frameInterval / 2) {
+        double shift = std::min(arrivalTime - presentationTime, sourceWaitTime);
+        anchorTime += shift;
+        presentationTime += shift;
+        sourceStalls++;
+    }
+    deadline = presentationTime + latencyBudget;
+    frameStartTime = arrivalTime;
+
+    // Engines that haven't been measured yet are tried optimistically
+    double remaining = deadline - arrivalTime;
+    if (actionCounts[FRAME_EXACT] + actionCounts[FRAME_APPROXIMATE] == 0) {
+        // Nothing has been mapped yet, so there is no previous output to reuse
+        currentAction = FRAME_EXACT;
+    } else if (remaining >= exactCost) {
+        currentAction = FRAME_EXACT;
+    } else if (remaining >= approximateCost) {
+        currentAction = FRAME_APPROXIMATE;
+    } else {
+        currentAction = FRAME_REUSE;
+    }
+    if (currentAction != FRAME_EXACT) exactCost *= COST_DECAY;
+    if (currentAction == FRAME_REUSE) approximateCost *= COST_DECAY;
+    return currentAction;
+}
+
+void LiveScheduler::frameDone() {
+    double finishTime = now();
+    double cost = finishTime - frameStartTime;
+    double *averageCost = (currentAction == FRAME_EXACT) ? &exactCost : (currentAction == FRAME_APPROXIMATE) ? &approximateCost : &reuseCost;
+    *averageCost = (*averageCost == 0) ? cost : (1 - COST_SMOOTHING) * (*averageCost) + COST_SMOOTHING * cost;
+
+    actionCounts[currentAction]++;
+    latencies.push_back(finishTime - presentationTime);
+    if (finishTime > deadline) missedDeadlines++;
+}
+
+// Stream timestamp before which frames have already missed their deadline, even if they cost nothing.
+// Those are better dropped before decoding than reused after it.
+double LiveScheduler::getExpiredTimestamp() {
+    return now() - latencyBudget - anchorTime + firstTimestamp;
+}
+
+void LiveScheduler::printLatencyReport() {
+    int frameCount = latencies.size();
+    std::cout << "Live frames: " << frameCount << " (exact: " << actionCounts[FRAME_EXACT] << ", approximate: " << actionCounts[FRAME_APPROXIMATE]
+              << ", reused: " << actionCounts[FRAME_REUSE] << ", dropped before scaling: " << droppedFrames << ")" << std::endl;
+    if (frameCount == 0) return;
+
+    std::vector<double> sortedLatencies = latencies;
+    std::sort(sortedLatencies.begin(), sortedLatencies.end());
+    // Nearest-rank percentiles
+    double p50 = sortedLatencies[(frameCount * 50 + 99) / 100 - 1];
+    double p99 = sortedLatencies[(frameCount * 99 + 99) / 100 - 1];
+    std::cout << "Latency budget: " << latencyBudget * 1000 << " ms, missed deadlines: " << missedDeadlines << ", source stalls: " << sourceStalls << std::endl;
+    std::cout << "End-to-end latency (ms): p50 " << p50 * 1000 << ", p99 " << p99 * 1000 << ", max " << sortedLatencies.back() * 1000 << std::endl;
+    std::cout << "Frame cost (ms): exact " << exactCost * 1000 << ", approximate " << approximateCost * 1000 << ", reuse " << reuseCost * 1000 << std::endl;
+}
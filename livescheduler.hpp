@@ -0,0 +1,86 @@
+#ifndef LIVESCHEDULER_HPP_INCLUDED
+#define LIVESCHEDULER_HPP_INCLUDED
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+
+enum FrameAction {
+    FRAME_EXACT,        // Map with FastPixelMap::convertImage
+    FRAME_APPROXIMATE,  // Map with the cheaper FastPixelMap::approximateConvertImage. With a candidate cap, no error bound.
+    FRAME_REUSE         // Dropped, reuse the previous frame's output
+};
+
+// Decides per frame how much work a live pipeline can afford. Until a frame has been mapped it always picks FRAME_EXACT.
+// The first frame anchors stream time to wall-clock time. Every later frame is due at
+// anchor + (timestamp - first timestamp), and has to be finished latencyBudget seconds after that (its deadline).
+// The scheduler keeps running estimates of what the exact and approximate engines cost and picks the best one
+// that still meets the deadline, or reuses the previous output. Frames that are already past their deadline when the
+// previous one finishes shouldn't be decoded at all, see getExpiredTimestamp.
+// If the demuxer had to wait for the frame's data (the source is slower than real time, or paused), the anchor is
+// moved by at most that wait, so the pipeline isn't blamed for latency the source caused. Decode and scaling time
+// always count against the pipeline.
+//
+// Per frame: frameReady(timestamp, source wait, frames dropped) once it is decoded, frameDone() once output is written,
+// then hand getExpiredTimestamp() to VideoDecoder::dropFramesBefore.
+class LiveScheduler {
+
+public:
+    LiveScheduler(double latencyBudget) {
+        this->latencyBudget = latencyBudget;
+        isAnchored = false;
+        anchorTime = 0;
+        firstTimestamp = 0;
+        lastTimestamp = 0;
+        frameInterval = 0;
+        presentationTime = 0;
+        deadline = 0;
+        frameStartTime = 0;
+        currentAction = FRAME_EXACT;
+        exactCost = 0;
+        approximateCost = 0;
+        reuseCost = 0;
+        for (int i = 0; i < 3; i++) actionCounts[i] = 0;
+        missedDeadlines = 0;
+        sourceStalls = 0;
+        droppedFrames = 0;
+    }
+
+    FrameAction frameReady(double timestamp, double sourceWaitTime, int framesDropped);
+    void frameDone();
+    double getExpiredTimestamp();
+    void printLatencyReport();
+
+private:
+    double latencyBudget;
+
+    bool isAnchored;
+    double anchorTime;
+    double firstTimestamp;
+    double lastTimestamp;
+    double frameInterval;
+
+    double presentationTime;
+    double deadline;
+    double frameStartTime;
+    FrameAction currentAction;
+
+    // Moving averages of processing time per action, in seconds. 0 until measured.
+    double exactCost;
+    double approximateCost;
+    double reuseCost;
+
+    int actionCounts[3];
+    int missedDeadlines;
+    int sourceStalls;
+    int droppedFrames;  // Dropped by the decoder, never reached frameReady
+    std::vector<double> latencies; // Finish time - presentation time
+
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+};
+
+
+#endif // LIVESCHEDULER_HPP_INCLUDED
@@ -1,6 +1,10 @@
 #include <iostream>
+#include <cstdlib>
 #include "decodevideo.hpp"
 #include "fastpixelmap.hpp"
+#include "rawframesource.hpp"
+#include "palvideo.hpp"
+#include "livescheduler.hpp"
 
 /*
 *   Workshop 3
@@ -71,9 +75,70 @@ void initializeExpandedColors() {
     return;
 }
 
+// Settings for the frames LiveScheduler degrades to FRAME_APPROXIMATE. Each pixel may be up to LIVE_TOLERANCE (sed)
+// worse than the nearest color, but the search also stops after LIVE_MAX_CANDIDATES of the 256 palette colors, which
+// removes that bound: approximate live frames have no error bound and their mapping error isn't measured.
+static const int LIVE_TOLERANCE = 1600;
+static const int LIVE_MAX_CANDIDATES = 16;
+
+// Live mode: maps frames from a pipe, FIFO or socket as they arrive and writes them to live.pvid.
+// Every frame has a deadline of latencyBudget seconds after it is due. When the pipeline falls behind,
+// LiveScheduler switches to approximate mapping or reuses the previous frame's output. Frames that have already
+// missed their deadline before they are even scaled are dropped, and written as repeats of the previous frame
+// so live.pvid keeps the input's frame rate.
+int runLive(string inputName, int width, int height, double latencyBudget) {
+    IOOptions ioOptions;
+    ioOptions.liveInput = true;
+    VideoDecoder decoder(width, height, inputName, ioOptions);
+    FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256);
+    PalVideoWriter pal8Video("live.pvid", width, height, (int)decoder.getFrameRate());
+    LiveScheduler scheduler(latencyBudget);
+
+    uint8_t *pal8Image = NULL;
+    while (true) {
+        uint8_t *image = decoder.readFrame();
+        if (image == NULL) break; // Stream closed
+
+        int framesDropped = decoder.getDroppedFrameCount();
+        for (int i = 0; i < framesDropped; i++) pal8Video.repeatFrame();
+        FrameAction action = scheduler.frameReady(decoder.getFrameTimestamp(), decoder.getDemuxWaitTime(), framesDropped);
+        // Nothing to reuse yet, the first frame is always mapped exactly
+        if (pal8Image == NULL) action = FRAME_EXACT;
+        if (action != FRAME_REUSE) {
+            delete[] pal8Image;
+            if (action == FRAME_EXACT) {
+                pal8Image = pixelMapper.convertImage(image, width, height, true);
+            } else {
+                pal8Image = pixelMapper.approximateConvertImage(image, width, height, true, LIVE_TOLERANCE, LIVE_MAX_CANDIDATES);
+            }
+        }
+        pal8Video.writeFrame(pal8Image, (uint8_t*)expandedPalette, 256);
+        scheduler.frameDone();
+        // Frames that can no longer meet their deadline are dropped before scaling, most of them before decoding
+        decoder.dropFramesBefore(scheduler.getExpiredTimestamp());
+    }
+    delete[] pal8Image;
+
+    scheduler.printLatencyReport();
+    return 0;
+}
+
+void finishTracing(const char *traceFileName) {
+    if (traceFileName != NULL) {
+        StageTracer::printSummary();
+        StageTracer::writeChromeTrace(traceFileName);
+    }
+}
+
 
-int main()
+// Usage: CSC379Final                                    Batch mode on RickRoll.mkv
+//        CSC379Final --live <pipe or url> [budget ms]  Live mode, see runLive
+int main(int argc, char *argv[])
 {
+    // PIXELMAP_TRACE=trace.json records per-stage timings and writes them as a Chrome trace
+    const char *traceFileName = getenv("PIXELMAP_TRACE");
+    if (traceFileName != NULL) StageTracer::setEnabled(true);
+
     BGRAPixel palette[16];
     for (int i = 0; i < 16; i++) {
         palette[i].blue = colorValues[i].blue;
@@ -87,13 +152,33 @@ int main()
     int width = 320;
     int height = 240;
 
+    if (argc >= 3 && string(argv[1]) == "--live") {
+        double latencyBudget = (argc >= 4) ? atof(argv[3]) / 1000 : 0.1;
+        if (latencyBudget <= 0) {
+            cerr << "Latency budget must be a positive number of milliseconds" << endl;
+            return 1;
+        }
+        int result = runLive(argv[2], width, height, latencyBudget);
+        finishTracing(traceFileName);
+        return result;
+    }
+
+    // For network mounts or spinning disks, read the input ahead on a background thread:
+    //IOOptions ioOptions;
+    //ioOptions.mode = IO_READAHEAD;
+    //VideoDecoder decoder(width, height, "RickRoll.mkv", ioOptions);
     VideoDecoder decoder(width, height, "RickRoll.mkv");
+    // To benchmark the mapper without decode noise, read pre-decoded BGRA frames instead. Those frames are not padded.
+    //RawFrameSource decoder(width, height, "RickRoll.bgra");
     //decoder.printVideoInfo();
     decoder.seekFrame(0);
     uint8_t* image;
     FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256);
+    // Short-lived workers can share prebuilt lookup tables instead of rebuilding them on every start:
+    //FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256, "/tmp");
     for (int i = 0; i < 1000; i++) {
         image = decoder.readFrame();
+        if (image == NULL) break; // End of video
 
         //cout << i << endl;
 
@@ -104,8 +189,17 @@ int main()
 
             pal8Image = pixelMapper.convertImage(image, width, height, true);
             writePal8PPM("paletteTest.ppm", width, height, pal8Image, (uint8_t*) expandedPalette);
+            // Compact alternative to one PPM per frame, see palvideo.hpp
+            //PalVideoWriter pal8Video("paletteTest.pvid", width, height);
+            //pal8Video.writeFrame(pal8Image, (uint8_t*) expandedPalette, 256);
             delete[] pal8Image;
 
+//            // Preview quality: accept colors up to 400 (squared distance) worse than the nearest, look at 32 colors at most
+//            pal8Image = pixelMapper.approximateConvertImage(image, width, height, true, 400, 32);
+//            MappingError error = pixelMapper.measureMappingError(image, width, height, true, pal8Image);
+//            cout << "Mean excess error: " << error.meanExcessSed << ", max: " << error.maxExcessSed << ", mismatched: " << error.mismatchFraction << endl;
+//            delete[] pal8Image;
+
 //            pal8Image = pixelMapper.fullSearchConvertImage(image, width, height, true);
 //            writePal8PPM("fsPaletteTest.ppm", width, height, pal8Image, (uint8_t*) expandedPalette);
 //            delete[] pal8Image;
@@ -114,6 +208,7 @@ int main()
 
     }
 
+    finishTracing(traceFileName);
     return 0;
 }
 
@@ -143,6 +238,15 @@ int main()
     Performance Gain compared to Full Search (Decoding/scaling time removed):      8.889x
 
 
+    Live mode can be tested locally by feeding a file through a FIFO at its native frame rate:
+
+    mkfifo /tmp/live.fifo
+    ffmpeg -re -i RickRoll.mkv -c copy -f matroska /tmp/live.fifo &
+    ./CSC379Final --live /tmp/live.fifo 100
+
+    A local socket works the same way with "unix:/path/to/socket" as the input.
+
+
     Authors' reported speed-up: ~20x depending on image
 
     Possible Reasons for difference in speed: My best guess is that the additional operations used
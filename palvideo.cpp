@@ -0,0 +1,343 @@
+#include "palvideo.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char HEADER_MAGIC[8] = {'P','A','L','8','V','I','D','1'};
+static const char TRAILER_MAGIC[8] = {'P','A','L','8','I','D','X','1'};
+static const uint32_t PALVIDEO_VERSION = 1;
+static const int HEADER_SIZE = 8 + 5*4;
+static const int TRAILER_SIZE = 8 + 4 + 8;
+static const int INDEX_ENTRY_SIZE = 8 + 8 + 1;
+static const int CHUNK_HEADER_SIZE = 1 + 4;
+static const int MIN_RUN = 4; // Shorter runs are cheaper to store as part of a literal
+
+static inline uint8_t *putUint32(uint8_t *out, uint32_t value) {
+    memcpy(out, &value, 4);
+    return out + 4;
+}
+
+static inline uint8_t *putUint64(uint8_t *out, uint64_t value) {
+    memcpy(out, &value, 8);
+    return out + 8;
+}
+
+static inline uint32_t getUint32(const uint8_t *in) {
+    uint32_t value;
+    memcpy(&value, in, 4);
+    return value;
+}
+
+static inline uint64_t getUint64(const uint8_t *in) {
+    uint64_t value;
+    memcpy(&value, in, 8);
+    return value;
+}
+
+static inline uint8_t *putVarint(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static inline const uint8_t *getVarint(const uint8_t *in, const uint8_t *end, uint32_t &value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 35; shift += 7) {
+        uint8_t byte = *in++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return in;
+    }
+    return NULL;
+}
+
+static inline uint64_t load64(const uint8_t *in) {
+    uint64_t value;
+    memcpy(&value, in, 8);
+    return value;
+}
+
+
+// Run-length codes plane (or plane XOR previous for delta frames). Runs are extended 8 bytes at a time,
+// so the long runs of 0 that unchanged areas produce in delta frames cost about one compare per 8 pixels.
+template <bool isDelta>
+static size_t encodePlane(const uint8_t *plane, const uint8_t *previous, int planeSize, uint8_t *out) {
+    uint8_t *outStart = out;
+    int literalStart = 0;
+    int i = 0;
+    while (i < planeSize) {
+        uint8_t value = isDelta ? (plane[i] ^ previous[i]) : plane[i];
+        uint64_t broadcast = value * 0x0101010101010101ULL;
+        int j = i + 1;
+        while (j + 8 <= planeSize) {
+            uint64_t word = isDelta ? (load64(plane + j) ^ load64(previous + j)) : load64(plane + j);
+            if (word != broadcast) break;
+            j += 8;
+        }
+        while (j < planeSize && (isDelta ? (plane[j] ^ previous[j]) : plane[j]) == value) j++;
+
+        if (j - i >= MIN_RUN) {
+            if (i > literalStart) {
+                out = putVarint(out, ((uint32_t)(i - literalStart) << 1) | 1);
+                for (int k = literalStart; k < i; k++) *out++ = isDelta ? (plane[k] ^ previous[k]) : plane[k];
+            }
+            out = putVarint(out, (uint32_t)(j - i) << 1);
+            *out++ = value;
+            literalStart = j;
+        }
+        i = j;
+    }
+    if (planeSize > literalStart) {
+        out = putVarint(out, ((uint32_t)(planeSize - literalStart) << 1) | 1);
+        for (int k = literalStart; k < planeSize; k++) *out++ = isDelta ? (plane[k] ^ previous[k]) : plane[k];
+    }
+    return out - outStart;
+}
+
+// Decodes a run-length coded plane in place. Delta frames are XORed onto the previous frame already in plane,
+// so a run of 0 is just a skip.
+static bool decodePlane(const uint8_t *in, const uint8_t *end, uint8_t *plane, int planeSize, bool isDelta) {
+    int position = 0;
+    while (in < end) {
+        uint32_t token;
+        in = getVarint(in, end, token);
+        if (in == NULL) return false;
+        uint32_t length = token >> 1;
+        if (length > (uint32_t)(planeSize - position)) return false;
+
+        if (token & 1) {
+            if (length > (uint32_t)(end - in)) return false;
+            if (isDelta) {
+                for (uint32_t k = 0; k < length; k++) plane[position+k] ^= in[k];
+            } else {
+                memcpy(plane + position, in, length);
+            }
+            in += length;
+        } else {
+            if (in >= end) return false;
+            uint8_t value = *in++;
+            if (!isDelta) {
+                memset(plane + position, value, length);
+            } else if (value != 0) {
+                for (uint32_t k = 0; k < length; k++) plane[position+k] ^= value;
+            }
+        }
+        position += length;
+    }
+    return position == planeSize;
+}
+
+
+void PalVideoWriter::writeHeader() {
+    uint8_t header[HEADER_SIZE];
+    memcpy(header, HEADER_MAGIC, 8);
+    uint8_t *out = putUint32(header + 8, PALVIDEO_VERSION);
+    out = putUint32(out, width);
+    out = putUint32(out, height);
+    out = putUint32(out, frameRate);
+    putUint32(out, keyframeInterval);
+    dstVideo.write((char*)header, HEADER_SIZE);
+    fileOffset = HEADER_SIZE;
+}
+
+void PalVideoWriter::writeChunk(uint8_t type, uint8_t *payload, uint32_t payloadSize) {
+    uint8_t chunkHeader[CHUNK_HEADER_SIZE];
+    chunkHeader[0] = type;
+    putUint32(chunkHeader + 1, payloadSize);
+    dstVideo.write((char*)chunkHeader, CHUNK_HEADER_SIZE);
+    dstVideo.write((char*)payload, payloadSize);
+    fileOffset += CHUNK_HEADER_SIZE + payloadSize;
+}
+
+int PalVideoWriter::writeFrame(uint8_t *pal8Image, uint8_t *palette, int paletteSize) {
+    TRACE_SCOPE("write_pvid");
+    if (!dstVideo.is_open()) return -1;
+
+    bool isKey = (frameCount % keyframeInterval == 0);
+    if (lastPalette.size() != (size_t)paletteSize*4 || memcmp(lastPalette.data(), palette, paletteSize*4) != 0) {
+        lastPalette.assign(palette, palette + paletteSize*4);
+        std::vector<uint8_t> payload(4 + paletteSize*4);
+        putUint32(payload.data(), paletteSize);
+        memcpy(payload.data() + 4, palette, paletteSize*4);
+        lastPaletteOffset = fileOffset;
+        writeChunk('P', payload.data(), payload.size());
+        isKey = true;
+    }
+
+    IndexEntry entry = {fileOffset, lastPaletteOffset, (uint8_t)isKey};
+    frameIndex.push_back(entry);
+
+    size_t encodedSize;
+    if (isKey) {
+        encodedSize = encodePlane<false>(pal8Image, NULL, planeSize, encodeBuffer);
+    } else {
+        encodedSize = encodePlane<true>(pal8Image, previousPlane, planeSize, encodeBuffer);
+    }
+    writeChunk(isKey ? 'K' : 'D', encodeBuffer, encodedSize);
+
+    memcpy(previousPlane, pal8Image, planeSize);
+    frameCount++;
+    return dstVideo.good() ? 0 : -1;
+}
+
+int PalVideoWriter::repeatFrame() {
+    TRACE_SCOPE("write_pvid");
+    if (!dstVideo.is_open() || frameCount == 0) return -1;
+
+    bool isKey = (frameCount % keyframeInterval == 0);
+    IndexEntry entry = {fileOffset, lastPaletteOffset, (uint8_t)isKey};
+    frameIndex.push_back(entry);
+
+    size_t encodedSize;
+    if (isKey) {
+        encodedSize = encodePlane<false>(previousPlane, NULL, planeSize, encodeBuffer);
+    } else {
+        uint8_t *out = putVarint(encodeBuffer, (uint32_t)planeSize << 1);
+        *out++ = 0;
+        encodedSize = out - encodeBuffer;
+    }
+    writeChunk(isKey ? 'K' : 'D', encodeBuffer, encodedSize);
+    frameCount++;
+    return dstVideo.good() ? 0 : -1;
+}
+
+// Writes the frame index and trailer. Called by the destructor if not called explicitly.
+int PalVideoWriter::close() {
+    if (!dstVideo.is_open()) return -1;
+
+    uint64_t indexOffset = fileOffset;
+    std::vector<uint8_t> index(frameIndex.size() * INDEX_ENTRY_SIZE + TRAILER_SIZE);
+    uint8_t *out = index.data();
+    for (size_t i = 0; i < frameIndex.size(); i++) {
+        out = putUint64(out, frameIndex[i].frameOffset);
+        out = putUint64(out, frameIndex[i].paletteOffset);
+        *out++ = frameIndex[i].isKey;
+    }
+    out = putUint64(out, indexOffset);
+    out = putUint32(out, frameCount);
+    memcpy(out, TRAILER_MAGIC, 8);
+    dstVideo.write((char*)index.data(), index.size());
+    fileOffset += index.size();
+
+    bool writeFailed = !dstVideo.good();
+    dstVideo.close();
+    if (writeFailed) {
+        std::cout << "PalVideoWriter: Failed writing video." << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+int PalVideoReader::openInputFile() {
+    int fileDescriptor = open(inputFileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) return -1;
+    struct stat fileInfo;
+    if (fstat(fileDescriptor, &fileInfo) != 0 || fileInfo.st_size < HEADER_SIZE + TRAILER_SIZE) {
+        ::close(fileDescriptor);
+        return -1;
+    }
+    mappedSize = fileInfo.st_size;
+    void *mapping = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    ::close(fileDescriptor);
+    if (mapping == MAP_FAILED) {
+        mappedSize = 0;
+        return -1;
+    }
+    mappedData = (uint8_t*)mapping;
+
+    const uint8_t *trailer = mappedData + mappedSize - TRAILER_SIZE;
+    if (memcmp(mappedData, HEADER_MAGIC, 8) != 0 || memcmp(trailer + 12, TRAILER_MAGIC, 8) != 0) {
+        std::cerr << "PalVideoReader: Not a .pvid file or the file was not closed." << std::endl;
+        closeInputFile();
+        return -1;
+    }
+    if (getUint32(mappedData + 8) != PALVIDEO_VERSION) {
+        std::cerr << "PalVideoReader: Unsupported version." << std::endl;
+        closeInputFile();
+        return -1;
+    }
+    width = getUint32(mappedData + 12);
+    height = getUint32(mappedData + 16);
+    frameRate = getUint32(mappedData + 20);
+
+    uint64_t indexOffset = getUint64(trailer);
+    frameCount = getUint32(trailer + 8);
+    if (indexOffset + (uint64_t)frameCount * INDEX_ENTRY_SIZE + TRAILER_SIZE != mappedSize) {
+        std::cerr << "PalVideoReader: Corrupt frame index." << std::endl;
+        closeInputFile();
+        return -1;
+    }
+    const uint8_t *in = mappedData + indexOffset;
+    for (int i = 0; i < frameCount; i++, in += INDEX_ENTRY_SIZE) {
+        frameOffsets.push_back(getUint64(in));
+        paletteOffsets.push_back(getUint64(in + 8));
+        keyFrames.push_back(in[16]);
+    }
+
+    plane = new uint8_t[width * height];
+    return 0;
+}
+
+void PalVideoReader::closeInputFile() {
+    if (mappedData != NULL) munmap(mappedData, mappedSize);
+    mappedData = NULL;
+    mappedSize = 0;
+    frameCount = 0;
+}
+
+bool PalVideoReader::loadPalette(uint64_t paletteOffset) {
+    if (paletteOffset == currentPaletteOffset && paletteSize > 0) return true;
+    if (paletteOffset + CHUNK_HEADER_SIZE + 4 > mappedSize || mappedData[paletteOffset] != 'P') return false;
+    const uint8_t *payload = mappedData + paletteOffset + CHUNK_HEADER_SIZE;
+    int size = getUint32(payload);
+    if (paletteOffset + CHUNK_HEADER_SIZE + 4 + (uint64_t)size*4 > mappedSize) return false;
+    palette.assign(payload + 4, payload + 4 + size*4);
+    paletteSize = size;
+    currentPaletteOffset = paletteOffset;
+    return true;
+}
+
+// Decodes frameNumber into plane. Delta frames expect plane to hold frameNumber-1.
+bool PalVideoReader::decodeFrame(int frameNumber) {
+    uint64_t offset = frameOffsets[frameNumber];
+    if (offset + CHUNK_HEADER_SIZE > mappedSize) return false;
+    uint8_t type = mappedData[offset];
+    uint32_t payloadSize = getUint32(mappedData + offset + 1);
+    const uint8_t *payload = mappedData + offset + CHUNK_HEADER_SIZE;
+    if (offset + CHUNK_HEADER_SIZE + payloadSize > mappedSize || (type != 'K' && type != 'D')) return false;
+    return decodePlane(payload, payload + payloadSize, plane, width * height, type == 'D');
+}
+
+uint8_t* PalVideoReader::readFrame() {
+    TRACE_SCOPE("read_pvid");
+    if (currentFrame >= frameCount) return NULL;
+    if (!loadPalette(paletteOffsets[currentFrame]) || !decodeFrame(currentFrame)) {
+        std::cerr << "PalVideoReader: Corrupt frame " << currentFrame << std::endl;
+        currentFrame = frameCount;
+        return NULL;
+    }
+    currentFrame++;
+    return plane;
+}
+
+// Decodes forward from the closest key frame at or before frameNumber. The next readFrame returns frameNumber.
+bool PalVideoReader::seekFrame(int frameNumber) {
+    if (frameNumber < 0 || frameNumber >= frameCount) return false;
+    if (frameNumber == currentFrame) return true;
+
+    int keyFrame = frameNumber;
+    while (keyFrame > 0 && !keyFrames[keyFrame]) keyFrame--;
+    // Already positioned between the key frame and the target, keep decoding from here
+    int startFrame = (currentFrame > keyFrame && currentFrame < frameNumber) ? currentFrame : keyFrame;
+    for (int i = startFrame; i < frameNumber; i++) {
+        if (!decodeFrame(i)) return false;
+    }
+    currentFrame = frameNumber;
+    return true;
+}
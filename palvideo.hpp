@@ -0,0 +1,161 @@
+#ifndef PALVIDEO_HPP_INCLUDED
+#define PALVIDEO_HPP_INCLUDED
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "trace.hpp"
+
+/*
+*   Indexed video container for FastPixelMap output (.pvid)
+*
+*   Header:  "PAL8VID1", version, width, height, frameRate, keyframeInterval (uint32 each)
+*   Chunks:  1 byte type, uint32 payload size, payload
+*            'P' palette:     uint32 paletteSize, paletteSize BGRA entries. Written once and again whenever it changes.
+*            'K' key frame:   index plane, run-length coded
+*            'D' delta frame: (index plane XOR previous index plane), run-length coded. Runs of 0 are skips.
+*   Index:   per frame {uint64 chunk offset, uint64 palette chunk offset, uint8 isKey}
+*   Trailer: uint64 index offset, uint32 frame count, "PAL8IDX1"
+*
+*   Run-length coding is a list of tokens. Each token starts with a varint (length << 1 | isLiteral).
+*   A run is followed by one byte that repeats length times, a literal by length bytes.
+*   All integers are little-endian.
+*/
+
+// Writes pal8 frames as they come out of FastPixelMap. A new key frame is forced every keyframeInterval
+// frames and whenever the palette changes.
+class PalVideoWriter {
+
+public:
+    PalVideoWriter(std::string outputFileName, int width, int height, int frameRate = 0, int keyframeInterval = 60) {
+
+        frameCount = 0;
+        fileOffset = 0;
+        lastPaletteOffset = 0;
+        this->width = width;
+        this->height = height;
+        this->frameRate = frameRate;
+        this->keyframeInterval = (keyframeInterval < 1) ? 1 : keyframeInterval;
+        planeSize = width * height;
+        previousPlane = new uint8_t[planeSize];
+        // Worst case is all literals: one varint every literal chunk plus the chunk header
+        encodeBuffer = new uint8_t[planeSize + planeSize/64 + 32];
+
+        dstVideo.open(outputFileName, std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!dstVideo.is_open()) {
+            std::cout << "PalVideoWriter: File could not be opened." << std::endl;
+        } else {
+            writeHeader();
+        }
+    }
+
+    ~PalVideoWriter() {
+        close();
+        delete[] previousPlane;
+        delete[] encodeBuffer;
+    }
+
+    int writeFrame(uint8_t *pal8Image, uint8_t *palette, int paletteSize);
+    // Writes the previous frame again, e.g. in place of a frame a live pipeline dropped, so the output keeps the
+    // input's timing. A single all-zero delta run, unless a key frame is due.
+    int repeatFrame();
+    int close();
+    long long getBytesWritten() { return fileOffset; }
+
+private:
+    std::fstream dstVideo;
+    int width;
+    int height;
+    int frameRate;
+    int keyframeInterval;
+    int planeSize;
+    int frameCount;
+
+    uint64_t fileOffset;
+    uint64_t lastPaletteOffset;
+    std::vector<uint8_t> lastPalette;
+    uint8_t *previousPlane;
+    uint8_t *encodeBuffer;
+
+    struct IndexEntry {
+        uint64_t frameOffset;
+        uint64_t paletteOffset;
+        uint8_t isKey;
+    };
+    std::vector<IndexEntry> frameIndex;
+
+    void writeHeader();
+    void writeChunk(uint8_t type, uint8_t *payload, uint32_t payloadSize);
+
+};
+
+
+// Decodes .pvid files. The file is mmap'ed and frames are decoded straight from the mapping.
+// readFrame returns the next pal8 frame (width * height bytes) or NULL at the end of the video.
+// The returned plane and palette are owned by the reader and are overwritten by the next read or seek.
+class PalVideoReader {
+
+public:
+    PalVideoReader(std::string inputFileName) {
+
+        frameCount = 0;
+        currentFrame = 0;
+        width = 0;
+        height = 0;
+        frameRate = 0;
+        paletteSize = 0;
+        currentPaletteOffset = 0;
+        mappedData = NULL;
+        mappedSize = 0;
+        plane = NULL;
+        this->inputFileName = inputFileName;
+
+        if (openInputFile() < 0) std::cerr << "PalVideoReader: Failed to open " << inputFileName << std::endl;
+    }
+
+    ~PalVideoReader() {
+        closeInputFile();
+        delete[] plane;
+    }
+
+    uint8_t *readFrame();
+    bool seekFrame(int frameNumber);
+
+    uint8_t *getPalette() { return palette.data(); }
+    int getPaletteSize() { return paletteSize; }
+    int getWidth() { return width; }
+    int getHeight() { return height; }
+    int getFrameRate() { return frameRate; }
+    int getFrameCount() { return frameCount; }
+
+private:
+    std::string inputFileName;
+    int width;
+    int height;
+    int frameRate;
+    int frameCount;
+    int currentFrame;
+
+    uint8_t *mappedData;
+    size_t mappedSize;
+    uint8_t *plane;
+
+    std::vector<uint8_t> palette;
+    int paletteSize;
+    uint64_t currentPaletteOffset;
+
+    std::vector<uint64_t> frameOffsets;
+    std::vector<uint64_t> paletteOffsets;
+    std::vector<uint8_t> keyFrames;
+
+    int openInputFile();
+    void closeInputFile();
+    bool loadPalette(uint64_t paletteOffset);
+    bool decodeFrame(int frameNumber);
+
+};
+
+
+#endif // PALVIDEO_HPP_INCLUDED
@@ -0,0 +1,286 @@
+#include "rawframesource.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char Y4M_MAGIC[] = "YUV4MPEG2";
+static const size_t Y4M_MAGIC_LENGTH = 9;
+
+// One byte from a pipe, retrying reads interrupted by signals. False at EOF or on error.
+static bool readByte(int fileDescriptor, char *c) {
+    while (true) {
+        ssize_t bytesRead = read(fileDescriptor, c, 1);
+        if (bytesRead == 1) return true;
+        if (bytesRead < 0 && errno == EINTR) continue;
+        if (bytesRead < 0) std::cerr << "RawFrameSource: Read failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+}
+
+int RawFrameSource::openInputFile() {
+
+    if (width <= 0 || height <= 0) {
+        std::cerr << "RawFrameSource: Width and height must be positive!" << std::endl;
+        return -1;
+    }
+
+    fileDescriptor = open(inputFileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) {
+        std::cerr << "RawFrameSource: File could not be opened." << std::endl;
+        return -1;
+    }
+
+    struct stat fileInfo;
+    if (fstat(fileDescriptor, &fileInfo) != 0) {
+        std::cerr << "RawFrameSource: fstat failed!" << std::endl;
+        closeInputFile();
+        return -1;
+    }
+
+    // Y4M is recognized by its magic, the extension only decides whether a missing magic is an error
+    std::string extension = (inputFileName.length() >= 4) ? inputFileName.substr(inputFileName.length()-4, 4) : "";
+    bool expectY4M = (extension == ".y4m");
+    isPipe = !S_ISREG(fileInfo.st_mode);
+
+    if (isPipe) {
+        // Pipes and FIFOs can't be mapped. Read the Y4M stream header one byte at a time (it is short),
+        // then read frames in large blocks.
+        std::string header;
+        char c;
+        while (header.length() < Y4M_MAGIC_LENGTH && readByte(fileDescriptor, &c)) header += c;
+        isY4M = (header == Y4M_MAGIC);
+        if (isY4M) {
+            while (readByte(fileDescriptor, &c) && c != '\n') header += c;
+            if (parseY4MHeader(header) < 0) {
+                closeInputFile();
+                return -1;
+            }
+            frameHeaderSize = 6; // "FRAME\n", frame parameters are not supported over a pipe
+            header.clear();
+        } else if (expectY4M) {
+            std::cerr << "RawFrameSource: Not a Y4M file." << std::endl;
+            closeInputFile();
+            return -1;
+        }
+        blockSize = std::max((size_t)readaheadFrames * (frameHeaderSize + frameSizeInBytes), header.length());
+        blockBuffer = new uint8_t[blockSize];
+        // Raw frames: the bytes read while looking for the magic are the start of the first frame
+        memcpy(blockBuffer, header.data(), header.length());
+        blockFilled = header.length();
+        return 0;
+    }
+
+    mappedSize = fileInfo.st_size;
+    if (mappedSize == 0) {
+        std::cerr << "RawFrameSource: File is empty." << std::endl;
+        closeInputFile();
+        return -1;
+    }
+    void *mapping = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "RawFrameSource: mmap failed!" << std::endl;
+        mappedSize = 0;
+        closeInputFile();
+        return -1;
+    }
+    mappedData = (uint8_t*)mapping;
+    madvise(mappedData, mappedSize, MADV_SEQUENTIAL);
+
+    isY4M = (mappedSize >= Y4M_MAGIC_LENGTH && memcmp(mappedData, Y4M_MAGIC, Y4M_MAGIC_LENGTH) == 0);
+    if (expectY4M && !isY4M) {
+        std::cerr << "RawFrameSource: Not a Y4M file." << std::endl;
+        closeInputFile();
+        return -1;
+    }
+    if (isY4M) {
+        uint8_t *headerEnd = (uint8_t*)memchr(mappedData, '\n', mappedSize);
+        if (headerEnd == NULL) {
+            std::cerr << "RawFrameSource: Y4M header is not terminated." << std::endl;
+            closeInputFile();
+            return -1;
+        }
+        if (parseY4MHeader(std::string((char*)mappedData, headerEnd - mappedData)) < 0) {
+            closeInputFile();
+            return -1;
+        }
+        return indexY4MFrames(headerEnd - mappedData + 1);
+    }
+
+    for (size_t offset = 0; offset + frameSizeInBytes <= mappedSize; offset += frameSizeInBytes) {
+        frameOffsets.push_back(offset);
+    }
+    if (mappedSize % frameSizeInBytes != 0) std::cerr << "RawFrameSource: File size is not a multiple of the frame size, ignoring trailing bytes." << std::endl;
+    return 0;
+}
+
+void RawFrameSource::closeInputFile() {
+    if (mappedData != NULL) munmap(mappedData, mappedSize);
+    mappedData = NULL;
+    mappedSize = 0;
+    delete[] blockBuffer;
+    blockBuffer = NULL;
+    if (fileDescriptor >= 0) close(fileDescriptor);
+    fileDescriptor = -1;
+}
+
+// Only Y4M streams carrying packed 4 byte pixels are accepted ("XPIXFMT=BGRA"). Planar YUV frames would need
+// a conversion into a separate buffer, which is what VideoDecoder is for.
+int RawFrameSource::parseY4MHeader(const std::string &header) {
+    if (header.compare(0, 9, "YUV4MPEG2") != 0) {
+        std::cerr << "RawFrameSource: Not a Y4M file." << std::endl;
+        return -1;
+    }
+
+    int headerWidth = 0;
+    int headerHeight = 0;
+    bool isBGRA = false;
+    size_t position = 9;
+    while (position < header.length()) {
+        size_t tokenEnd = header.find(' ', position);
+        if (tokenEnd == std::string::npos) tokenEnd = header.length();
+        std::string token = header.substr(position, tokenEnd - position);
+        position = tokenEnd + 1;
+        if (token.empty()) continue;
+
+        if (token[0] == 'W') {
+            headerWidth = atoi(token.c_str()+1);
+        } else if (token[0] == 'H') {
+            headerHeight = atoi(token.c_str()+1);
+        } else if (token[0] == 'F') {
+            int numerator = 0, denominator = 0;
+            if (sscanf(token.c_str()+1, "%d:%d", &numerator, &denominator) == 2 && denominator != 0) frameRate = numerator / denominator;
+        } else if (token == "XPIXFMT=BGRA") {
+            isBGRA = true;
+        }
+    }
+
+    if (!isBGRA) {
+        std::cerr << "RawFrameSource: Y4M frames must be packed BGRA (XPIXFMT=BGRA)." << std::endl;
+        return -1;
+    }
+    // Callers size their buffers from the width and height they asked for, so a different frame size can't be used
+    if (headerWidth != width || headerHeight != height) {
+        std::cerr << "RawFrameSource: Y4M frame size " << headerWidth << "x" << headerHeight << " does not match " << width << "x" << height << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Walks the FRAME headers once so frames can be located (and seeked to) without touching their pixel data.
+int RawFrameSource::indexY4MFrames(size_t dataStart) {
+    size_t offset = dataStart;
+    while (offset + 5 <= mappedSize) {
+        if (memcmp(mappedData + offset, "FRAME", 5) != 0) {
+            std::cerr << "RawFrameSource: Missing FRAME header at byte " << offset << std::endl;
+            return (frameOffsets.empty()) ? -1 : 0;
+        }
+        uint8_t *headerEnd = (uint8_t*)memchr(mappedData + offset, '\n', mappedSize - offset);
+        if (headerEnd == NULL) break;
+        size_t pixelOffset = headerEnd - mappedData + 1;
+        if (pixelOffset + frameSizeInBytes > mappedSize) break;
+        frameOffsets.push_back(pixelOffset);
+        offset = pixelOffset + frameSizeInBytes;
+    }
+    return 0;
+}
+
+
+uint8_t* RawFrameSource::readFrame() {
+    TRACE_SCOPE("read_raw");
+    if (isPipe) return readPipeFrame();
+    return readMappedFrame();
+}
+
+uint8_t* RawFrameSource::readMappedFrame() {
+    if (mappedData == NULL || frameCount >= (int)frameOffsets.size()) return NULL;
+
+    // Ask the kernel to start reading the next readaheadFrames frames once the current frame is within
+    // readaheadFrames of the end of the region that was last advised. Keeps it to one madvise per window.
+    int lastAhead = std::min(frameCount + readaheadFrames, (int)frameOffsets.size() - 1);
+    if (frameOffsets[lastAhead] + frameSizeInBytes > adviseEnd) {
+        int lastAdvised = std::min(frameCount + 2 * readaheadFrames, (int)frameOffsets.size() - 1);
+        long pageSize = sysconf(_SC_PAGESIZE);
+        size_t adviseStart = std::max(adviseEnd, frameOffsets[frameCount]);
+        adviseStart -= adviseStart % pageSize;
+        adviseEnd = frameOffsets[lastAdvised] + frameSizeInBytes;
+        madvise(mappedData + adviseStart, adviseEnd - adviseStart, MADV_WILLNEED);
+    }
+
+    return mappedData + frameOffsets[frameCount++];
+}
+
+// Reads from the pipe until at least one whole frame is buffered, or EOF. Whatever else the pipe already has is
+// taken as well, up to blockSize, but a live source is never waited on for more than one frame.
+// The partial frame left over from the last fill is moved to the front of the buffer first.
+size_t RawFrameSource::fillBlock() {
+    size_t frameStride = frameHeaderSize + frameSizeInBytes;
+    size_t remainder = blockFilled - blockOffset;
+    memmove(blockBuffer, blockBuffer + blockOffset, remainder);
+    blockFilled = remainder;
+    blockOffset = 0;
+    while (blockFilled < frameStride) {
+        ssize_t bytesRead = read(fileDescriptor, blockBuffer + blockFilled, blockSize - blockFilled);
+        if (bytesRead < 0 && errno == EINTR) continue; // Interrupted by a signal, not the end of the stream
+        if (bytesRead < 0) std::cerr << "RawFrameSource: Read failed: " << strerror(errno) << std::endl;
+        if (bytesRead <= 0) {
+            pipeEOF = true;
+            break;
+        }
+        blockFilled += bytesRead;
+    }
+    return blockFilled;
+}
+
+uint8_t* RawFrameSource::readPipeFrame() {
+    if (blockBuffer == NULL) return NULL;
+
+    size_t frameStride = frameHeaderSize + frameSizeInBytes;
+    if (blockOffset + frameStride > blockFilled) {
+        if (pipeEOF || fillBlock() < frameStride) return NULL;
+    }
+
+    uint8_t *frameStart = blockBuffer + blockOffset;
+    if (frameHeaderSize > 0 && memcmp(frameStart, "FRAME\n", frameHeaderSize) != 0) {
+        std::cerr << "RawFrameSource: Bad FRAME header in pipe." << std::endl;
+        pipeEOF = true;
+        blockFilled = 0;
+        return NULL;
+    }
+    blockOffset += frameStride;
+    frameCount++;
+    return frameStart + frameHeaderSize;
+}
+
+
+// Pipes can only be seeked forward, by reading and discarding frames.
+bool RawFrameSource::seekFrame(int frameNumber) {
+    if (frameNumber < 0) return false;
+
+    if (isPipe) {
+        if (frameNumber < frameCount) return false;
+        while (frameCount < frameNumber) {
+            if (readPipeFrame() == NULL) return false;
+        }
+        return true;
+    }
+
+    if (frameNumber >= (int)frameOffsets.size()) return false;
+    frameCount = frameNumber;
+    adviseEnd = 0;
+    return true;
+}
+
+void RawFrameSource::printVideoInfo() {
+    std::cout << "Input: " << inputFileName << (isY4M ? " (Y4M" : " (raw BGRA") << (isPipe ? ", pipe)" : ", mmap)") << std::endl;
+    std::cout << "Frame size: " << width << "x" << height << ", " << frameSizeInBytes << " bytes" << std::endl;
+    if (!isPipe) std::cout << "Frames: " << frameOffsets.size() << std::endl;
+    if (frameRate > 0) std::cout << "Frame rate: " << frameRate << std::endl;
+    std::cout << "Readahead: " << readaheadFrames << " frames" << std::endl;
+}
@@ -0,0 +1,97 @@
+#ifndef RAWFRAMESOURCE_HPP_INCLUDED
+#define RAWFRAMESOURCE_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "trace.hpp"
+
+
+// Reads raw BGRA frames (or Y4M files whose frames are packed 4 bytes per pixel) without going through libav.
+// Same interface as VideoDecoder::readFrame, but the returned pointer points straight into the mmap'ed file
+// (or into the block buffer when reading from a pipe), so no frame is ever copied. Frames are not padded,
+// so pass isPadded = false to FastPixelMap and writePPM.
+// The pointer is only valid until the next call to readFrame. readFrame returns NULL at end of input.
+class RawFrameSource {
+
+public:
+    RawFrameSource(int width, int height, std::string inputFileName, int readaheadFrames = 8) {
+
+        frameCount = 0;
+        frameRate = 0;
+        this->width = width;
+        this->height = height;
+        this->inputFileName = inputFileName;
+        this->readaheadFrames = (readaheadFrames < 1) ? 1 : readaheadFrames;
+        frameSizeInBytes = width * height * 4; // BGRA
+        frameHeaderSize = 0;
+
+        fileDescriptor = -1;
+        mappedData = NULL;
+        mappedSize = 0;
+        adviseEnd = 0;
+        isY4M = false;
+        isPipe = false;
+        pipeEOF = false;
+        blockBuffer = NULL;
+        blockSize = 0;
+        blockFilled = 0;
+        blockOffset = 0;
+
+        if (openInputFile() < 0) std::cerr << "RawFrameSource: Failed to open " << inputFileName << std::endl;
+    }
+
+    ~RawFrameSource() {
+        closeInputFile();
+    }
+
+    uint8_t *readFrame();
+    bool seekFrame(int frameNumber);
+    void printVideoInfo();
+
+    int getWidth() { return width; }
+    int getHeight() { return height; }
+    int getFrameRate() { return frameRate; }
+
+private:
+
+    int frameCount;
+    int frameSizeInBytes;
+    int frameRate;
+
+    int width;
+    int height;
+    std::string inputFileName;
+    int readaheadFrames;
+
+    int fileDescriptor;
+    bool isY4M;
+    bool isPipe;
+
+    // mmap mode
+    uint8_t *mappedData;
+    size_t mappedSize;
+    size_t adviseEnd; // End of the region already passed to madvise(MADV_WILLNEED)
+    std::vector<size_t> frameOffsets; // Offset of each frame's pixel data within the mapping
+
+    // Pipe mode. Frames are read in blocks of up to readaheadFrames frames and handed out from the block buffer.
+    bool pipeEOF;
+    int frameHeaderSize; // Size of the per-frame "FRAME\n" header for Y4M over a pipe, otherwise 0
+    uint8_t *blockBuffer;
+    size_t blockSize;
+    size_t blockFilled;
+    size_t blockOffset;
+
+    int openInputFile();
+    void closeInputFile();
+    int parseY4MHeader(const std::string &header);
+    int indexY4MFrames(size_t dataStart);
+    uint8_t *readMappedFrame();
+    uint8_t *readPipeFrame();
+    size_t fillBlock();
+
+};
+
+
+#endif // RAWFRAMESOURCE_HPP_INCLUDED
@@ -0,0 +1,242 @@
+#include "readaheadio.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+int ReadAheadIO::openInputFile() {
+    fileDescriptor = open(inputFileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) return -1;
+
+    struct stat fileInfo;
+    if (fstat(fileDescriptor, &fileInfo) != 0) {
+        closeInputFile();
+        return -1;
+    }
+    isPipe = !S_ISREG(fileInfo.st_mode);
+    if (!isPipe) fileSize = fileInfo.st_size;
+
+    if (options.mode == IO_MMAP && !isPipe && fileSize > 0) {
+        void *mapping = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (mapping != MAP_FAILED) {
+            mappedData = (uint8_t*)mapping;
+            mappedSize = fileSize;
+            madvise(mappedData, mappedSize, MADV_SEQUENTIAL);
+        }
+    }
+
+    if (mappedData == NULL) {
+        // Readahead mode, also used when mmap was requested but isn't possible
+        options.mode = IO_READAHEAD;
+        blocks.resize(options.readaheadDepth);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            blocks[i].data.resize(options.bufferSize);
+            freeBlocks.push_back(&blocks[i]);
+        }
+        readerThread = std::thread(&ReadAheadIO::readerLoop, this);
+    }
+
+    uint8_t *avioBuffer = (uint8_t*)av_malloc(options.avioBufferSize);
+    if (avioBuffer == NULL) {
+        closeInputFile();
+        return -1;
+    }
+    pAVIOContext = avio_alloc_context(avioBuffer, options.avioBufferSize, 0, this, readPacket, NULL, isPipe ? NULL : seekPacket);
+    if (pAVIOContext == NULL) {
+        av_free(avioBuffer);
+        closeInputFile();
+        return -1;
+    }
+    if (isPipe) pAVIOContext->seekable = 0;
+    return 0;
+}
+
+void ReadAheadIO::closeInputFile() {
+    if (readerThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(blockMutex);
+            stopReader = true;
+        }
+        blockFreedCondition.notify_all();
+        readerThread.join();
+    }
+    if (mappedData != NULL) munmap(mappedData, mappedSize);
+    mappedData = NULL;
+    mappedSize = 0;
+    if (fileDescriptor >= 0) close(fileDescriptor);
+    fileDescriptor = -1;
+    if (pAVIOContext != NULL) {
+        av_freep(&pAVIOContext->buffer);
+        avio_context_free(&pAVIOContext);
+    }
+}
+
+
+// Background thread: keeps every free block filled with the next part of the file.
+void ReadAheadIO::readerLoop() {
+    std::unique_lock<std::mutex> lock(blockMutex);
+    while (true) {
+        blockFreedCondition.wait(lock, [this] { return stopReader || (!readerEOF && !freeBlocks.empty()); });
+        if (stopReader) return;
+
+        Block *block = freeBlocks.back();
+        freeBlocks.pop_back();
+        uint64_t readGeneration = generation;
+        int64_t readOffset = readerPosition;
+        lock.unlock();
+
+        ssize_t readResult;
+        if (isPipe) {
+            // Don't sit in read() forever on an idle pipe, so the destructor can stop this thread
+            struct pollfd pipePoll = {fileDescriptor, POLLIN, 0};
+            bool stopping = false;
+            while (!stopping && poll(&pipePoll, 1, 100) == 0) {
+                std::lock_guard<std::mutex> stopLock(blockMutex);
+                stopping = stopReader;
+            }
+            readResult = stopping ? 0 : read(fileDescriptor, block->data.data(), block->data.size());
+        } else {
+            readResult = pread(fileDescriptor, block->data.data(), block->data.size(), readOffset);
+        }
+
+        lock.lock();
+        if (readGeneration != generation || stopReader) {
+            // A seek happened while reading, this block is for the old position
+            freeBlocks.push_back(block);
+            continue;
+        }
+        if (readResult <= 0) {
+            if (readResult < 0) std::cerr << "ReadAheadIO: Read failed!" << std::endl;
+            readerEOF = true;
+            freeBlocks.push_back(block);
+        } else {
+            block->offset = readOffset;
+            block->size = readResult;
+            filledBlocks.push_back(block);
+            readerPosition += readResult;
+        }
+        blockFilledCondition.notify_one();
+    }
+}
+
+int ReadAheadIO::readBlocks(uint8_t *buffer, int bufferSize) {
+    std::unique_lock<std::mutex> lock(blockMutex);
+    if (filledBlocks.empty() && !readerEOF) {
+        // The reader thread has fallen behind, this is the only place the demuxer waits on disk
+        TRACE_SCOPE("io_stall");
+        auto stallStart = std::chrono::steady_clock::now();
+        blockFilledCondition.wait(lock, [this] { return !filledBlocks.empty() || readerEOF; });
+        stallNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - stallStart).count();
+        stallCount++;
+    }
+    if (filledBlocks.empty()) return AVERROR_EOF;
+
+    Block *block = filledBlocks.front();
+    int copySize = std::min((size_t)bufferSize, block->size - frontBlockOffset);
+    memcpy(buffer, block->data.data() + frontBlockOffset, copySize);
+    frontBlockOffset += copySize;
+    position += copySize;
+    bytesRead += copySize;
+
+    if (frontBlockOffset == block->size) {
+        filledBlocks.pop_front();
+        freeBlocks.push_back(block);
+        frontBlockOffset = 0;
+        blockFreedCondition.notify_one();
+    }
+    return copySize;
+}
+
+int ReadAheadIO::readMapped(uint8_t *buffer, int bufferSize) {
+    if (position >= (int64_t)mappedSize) return AVERROR_EOF;
+
+    // Keep readaheadDepth * bufferSize bytes ahead of the demuxer advised, one madvise per bufferSize consumed
+    if (position + options.bufferSize > (int64_t)adviseEnd) {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        size_t adviseStart = std::max(adviseEnd, (size_t)position);
+        adviseStart -= adviseStart % pageSize;
+        adviseEnd = std::min(mappedSize, (size_t)position + (size_t)options.bufferSize * options.readaheadDepth);
+        madvise(mappedData + adviseStart, adviseEnd - adviseStart, MADV_WILLNEED);
+    }
+
+    int copySize = std::min((int64_t)bufferSize, (int64_t)mappedSize - position);
+    memcpy(buffer, mappedData + position, copySize);
+    position += copySize;
+    bytesRead += copySize;
+    return copySize;
+}
+
+int64_t ReadAheadIO::seekTo(int64_t offset, int whence) {
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) return (fileSize >= 0) ? fileSize : AVERROR(ENOSYS);
+    if (isPipe) return AVERROR(ESPIPE);
+
+    int64_t target;
+    if (whence == SEEK_SET) {
+        target = offset;
+    } else if (whence == SEEK_CUR) {
+        target = position + offset;
+    } else if (whence == SEEK_END) {
+        target = fileSize + offset;
+    } else {
+        return AVERROR(EINVAL);
+    }
+    if (target < 0) return AVERROR(EINVAL);
+
+    if (mappedData != NULL) {
+        position = target;
+        adviseEnd = target;
+        return target;
+    }
+
+    std::lock_guard<std::mutex> lock(blockMutex);
+    // Skip over blocks entirely before the target. If the target is in a block that is already read, use it.
+    while (!filledBlocks.empty() && target >= filledBlocks.front()->offset + (int64_t)filledBlocks.front()->size) {
+        freeBlocks.push_back(filledBlocks.front());
+        filledBlocks.pop_front();
+        frontBlockOffset = 0;
+    }
+    if (!filledBlocks.empty() && target >= filledBlocks.front()->offset) {
+        frontBlockOffset = target - filledBlocks.front()->offset;
+    } else if (filledBlocks.empty() && target == readerPosition) {
+        // Reader thread is already headed there
+        frontBlockOffset = 0;
+    } else {
+        while (!filledBlocks.empty()) {
+            freeBlocks.push_back(filledBlocks.front());
+            filledBlocks.pop_front();
+        }
+        frontBlockOffset = 0;
+        generation++;
+        readerPosition = target;
+        readerEOF = false;
+    }
+    position = target;
+    blockFreedCondition.notify_one();
+    return target;
+}
+
+int ReadAheadIO::readPacket(void *opaque, uint8_t *buffer, int bufferSize) {
+    ReadAheadIO *io = (ReadAheadIO*)opaque;
+    if (io->mappedData != NULL) return io->readMapped(buffer, bufferSize);
+    return io->readBlocks(buffer, bufferSize);
+}
+
+int64_t ReadAheadIO::seekPacket(void *opaque, int64_t offset, int whence) {
+    return ((ReadAheadIO*)opaque)->seekTo(offset, whence);
+}
+
+
+void ReadAheadIO::printIOStats() {
+    std::cout << "I/O mode: " << ((options.mode == IO_MMAP) ? "mmap" : "readahead thread") << (isPipe ? " (pipe)" : "") << std::endl;
+    std::cout << "Buffer size: " << options.bufferSize << " bytes, readahead depth: " << options.readaheadDepth
+              << ", AVIO buffer: " << options.avioBufferSize << " bytes" << std::endl;
+    std::cout << "Bytes read: " << bytesRead << ", stalls: " << stallCount << " (" << stallNs / 1e6 << " ms)" << std::endl;
+}
@@ -0,0 +1,128 @@
+#ifndef READAHEADIO_HPP_INCLUDED
+#define READAHEADIO_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+enum IOMode {
+    IO_DEFAULT,     // libavformat's own file I/O
+    IO_READAHEAD,   // Background thread reads ahead in large blocks
+    IO_MMAP         // Serve reads from an mmap of the file. Falls back to IO_READAHEAD for pipes.
+};
+
+struct IOOptions {
+    IOMode mode = IO_DEFAULT;
+    int bufferSize = 4 * 1024 * 1024;   // Size of each readahead block, and of the mmap readahead window step
+    int readaheadDepth = 8;             // Number of blocks kept in flight ahead of the demuxer
+    int avioBufferSize = 256 * 1024;    // Buffer handed to avio_alloc_context
+    bool liveInput = false;             // Live pipe or socket: small probe, no demuxer buffering. Works with any mode.
+};
+
+
+// Custom AVIOContext for VideoDecoder. In readahead mode a background thread keeps up to readaheadDepth
+// blocks of bufferSize bytes filled ahead of the demuxer, so av_read_frame only waits on disk when the
+// reader thread has fallen behind (counted as a stall). Seeks inside the current block are served from it,
+// other seeks restart the reader thread at the new position.
+class ReadAheadIO {
+
+public:
+    ReadAheadIO(std::string inputFileName, IOOptions options) {
+
+        this->inputFileName = inputFileName;
+        this->options = options;
+        if (this->options.bufferSize < 4096) this->options.bufferSize = 4096;
+        if (this->options.readaheadDepth < 1) this->options.readaheadDepth = 1;
+        if (this->options.avioBufferSize < 4096) this->options.avioBufferSize = 4096;
+
+        fileDescriptor = -1;
+        fileSize = -1;
+        isPipe = false;
+        pAVIOContext = NULL;
+        mappedData = NULL;
+        mappedSize = 0;
+        adviseEnd = 0;
+        position = 0;
+        readerPosition = 0;
+        frontBlockOffset = 0;
+        generation = 0;
+        readerEOF = false;
+        stopReader = false;
+        bytesRead = 0;
+        stallCount = 0;
+        stallNs = 0;
+
+        if (openInputFile() < 0) std::cerr << "ReadAheadIO: Failed to open " << inputFileName << std::endl;
+    }
+
+    ~ReadAheadIO() {
+        closeInputFile();
+    }
+
+    // NULL if the file could not be opened
+    AVIOContext *getAVIOContext() { return pAVIOContext; }
+    void printIOStats();
+
+private:
+    std::string inputFileName;
+    IOOptions options;
+    int fileDescriptor;
+    int64_t fileSize;
+    bool isPipe;
+    AVIOContext *pAVIOContext;
+
+    // Position of the next byte handed to libavformat
+    int64_t position;
+
+    // mmap mode
+    uint8_t *mappedData;
+    size_t mappedSize;
+    size_t adviseEnd;
+
+    // Readahead mode
+    struct Block {
+        std::vector<uint8_t> data;
+        int64_t offset;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    std::deque<Block*> filledBlocks;
+    std::vector<Block*> freeBlocks;
+    size_t frontBlockOffset;  // Bytes of filledBlocks.front() already consumed
+    int64_t readerPosition;   // File offset of the next block the reader thread will read
+    uint64_t generation;      // Bumped on every seek so the reader thread drops blocks read for the old position
+    bool readerEOF;
+    bool stopReader;
+    std::mutex blockMutex;
+    std::condition_variable blockFilledCondition;
+    std::condition_variable blockFreedCondition;
+    std::thread readerThread;
+
+    // Stats
+    int64_t bytesRead;
+    int64_t stallCount;
+    int64_t stallNs;
+
+    int openInputFile();
+    void closeInputFile();
+    void readerLoop();
+    int readMapped(uint8_t *buffer, int bufferSize);
+    int readBlocks(uint8_t *buffer, int bufferSize);
+    int64_t seekTo(int64_t offset, int whence);
+
+    static int readPacket(void *opaque, uint8_t *buffer, int bufferSize);
+    static int64_t seekPacket(void *opaque, int64_t offset, int whence);
+
+};
+
+
+#endif // READAHEADIO_HPP_INCLUDED
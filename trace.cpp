@@ -0,0 +1,112 @@
+#include "trace.hpp"
+
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+bool StageTracer::enabled = false;
+
+// One ring per thread. Rings are created on a thread's first event and kept after the thread exits,
+// so its events can still be exported.
+struct TraceRing {
+    int threadId;
+    uint64_t head; // Total number of events ever recorded, head % RING_CAPACITY is the next slot
+    TraceEvent events[StageTracer::RING_CAPACITY];
+};
+
+static std::mutex ringsMutex;
+static std::vector<TraceRing*> rings;
+static thread_local TraceRing *threadRing = NULL;
+
+static TraceRing *createThreadRing() {
+    TraceRing *ring = new TraceRing;
+    ring->head = 0;
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    ring->threadId = rings.size() + 1;
+    rings.push_back(ring);
+    return ring;
+}
+
+void StageTracer::record(const char *stage, int64_t startNs, int64_t endNs) {
+    if (threadRing == NULL) threadRing = createThreadRing();
+    TraceEvent &event = threadRing->events[threadRing->head % RING_CAPACITY];
+    event.stage = stage;
+    event.startNs = startNs;
+    event.durationNs = endNs - startNs;
+    threadRing->head++;
+}
+
+// Calls function(threadId, event) for every retained event, oldest first per thread.
+template <typename Function>
+static void forEachEvent(Function function) {
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (size_t r = 0; r < rings.size(); r++) {
+        TraceRing *ring = rings[r];
+        uint64_t first = (ring->head > (uint64_t)StageTracer::RING_CAPACITY) ? ring->head - StageTracer::RING_CAPACITY : 0;
+        for (uint64_t i = first; i < ring->head; i++) {
+            function(ring->threadId, ring->events[i % StageTracer::RING_CAPACITY]);
+        }
+    }
+}
+
+// Chrome trace event format, open with chrome://tracing or ui.perfetto.dev
+int StageTracer::writeChromeTrace(std::string outputFileName) {
+    std::fstream dstTrace(outputFileName, std::ios::out | std::ios::trunc);
+    if (!dstTrace.is_open()) {
+        std::cout << "writeChromeTrace: File could not be opened." << std::endl;
+        return -1;
+    }
+
+    int64_t originNs = -1;
+    forEachEvent([&](int threadId, const TraceEvent &event) {
+        if (originNs < 0 || event.startNs < originNs) originNs = event.startNs;
+    });
+
+    dstTrace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    dstTrace << std::fixed << std::setprecision(3);
+    bool first = true;
+    forEachEvent([&](int threadId, const TraceEvent &event) {
+        dstTrace << (first ? "\n" : ",\n");
+        dstTrace << "{\"name\":\"" << event.stage << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << threadId
+                 << ",\"ts\":" << (event.startNs - originNs) / 1000.0 << ",\"dur\":" << event.durationNs / 1000.0 << "}";
+        first = false;
+    });
+    dstTrace << "\n]}\n";
+    dstTrace.close();
+    return 0;
+}
+
+void StageTracer::printSummary() {
+    std::map<std::string, std::vector<int64_t>> stageDurations;
+    forEachEvent([&](int threadId, const TraceEvent &event) {
+        stageDurations[event.stage].push_back(event.durationNs);
+    });
+
+    std::cout << std::left << std::setw(20) << "Stage" << std::right << std::setw(10) << "Count" << std::setw(12) << "Mean(ms)"
+              << std::setw(12) << "p50(ms)" << std::setw(12) << "p99(ms)" << std::setw(12) << "Max(ms)" << std::setw(12) << "Total(s)" << std::endl;
+    std::cout << std::fixed;
+    for (auto &stage : stageDurations) {
+        std::vector<int64_t> &durations = stage.second;
+        std::sort(durations.begin(), durations.end());
+        int64_t total = 0;
+        for (size_t i = 0; i < durations.size(); i++) total += durations[i];
+        size_t count = durations.size();
+        // Nearest-rank percentiles
+        int64_t p50 = durations[(count * 50 + 99) / 100 - 1];
+        int64_t p99 = durations[(count * 99 + 99) / 100 - 1];
+        std::cout << std::left << std::setw(20) << stage.first << std::right << std::setw(10) << count
+                  << std::setprecision(4) << std::setw(12) << total / 1e6 / count << std::setw(12) << p50 / 1e6
+                  << std::setw(12) << p99 / 1e6 << std::setw(12) << durations.back() / 1e6
+                  << std::setprecision(3) << std::setw(12) << total / 1e9 << std::endl;
+    }
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// Drops all recorded events. The rings stay registered.
+void StageTracer::clear() {
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (size_t r = 0; r < rings.size(); r++) rings[r]->head = 0;
+}
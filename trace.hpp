@@ -0,0 +1,72 @@
+#ifndef TRACE_HPP_INCLUDED
+#define TRACE_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+// Per-stage latency tracing.
+// Wrap a stage in TRACE_SCOPE("name") and every execution of that scope is recorded into a ring buffer owned by
+// the calling thread. When tracing is disabled a scope costs one branch on a global flag. Building with
+// -DDISABLE_TRACING removes the scopes completely.
+// Stage names must be string literals (or otherwise live until the trace is exported).
+
+struct TraceEvent {
+    const char *stage;
+    int64_t startNs;
+    int64_t durationNs;
+};
+
+class StageTracer {
+
+public:
+    static void setEnabled(bool enabled) { StageTracer::enabled = enabled; }
+    static bool isEnabled() { return enabled; }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    static void record(const char *stage, int64_t startNs, int64_t endNs);
+
+    // Export functions read every thread's ring buffer, call them once the traced threads are idle.
+    // Only the most recent RING_CAPACITY events of each thread are kept.
+    static int writeChromeTrace(std::string outputFileName);
+    static void printSummary();
+    static void clear();
+
+    static const int RING_CAPACITY = 1 << 16;
+
+private:
+    static bool enabled;
+
+};
+
+class ScopedTimer {
+
+public:
+    ScopedTimer(const char *stage) {
+        this->stage = stage;
+        startNs = StageTracer::isEnabled() ? StageTracer::now() : -1;
+    }
+
+    ~ScopedTimer() {
+        if (startNs >= 0) StageTracer::record(stage, startNs, StageTracer::now());
+    }
+
+private:
+    const char *stage;
+    int64_t startNs;
+
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#ifdef DISABLE_TRACING
+#define TRACE_SCOPE(stage)
+#else
+#define TRACE_SCOPE(stage) ScopedTimer TRACE_CONCAT(scopedTimer, __LINE__)(stage)
+#endif
+
+
+#endif // TRACE_HPP_INCLUDED